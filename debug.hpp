@@ -71,6 +71,12 @@
 // completely no runtime overhead
 // `#define DEBUG_LEVEL 1` (default when !defined NDEBUG) - enable debug output,
 // prints everything you asked to print
+// `#define DEBUG_RELEASE_CHECKS 0` (default) - DEBUG_LEVEL 0 also drops all
+// assertion checks
+// `#define DEBUG_RELEASE_CHECKS 1` - DEBUG_LEVEL 0 keeps debug().check() and
+// debug().fail() (but nothing else), a passing check costs one compare and
+// branch, the message is only built on failure (operands printed with
+// operator<<), then DEBUG_PANIC_METHOD applies
 //
 // `#define DEBUG_STEPPING 0` (default) - no step debugging
 // `#define DEBUG_STEPPING 1` - enable step debugging, stops whenever debug
@@ -83,16 +89,134 @@
 // of debug output (e.g. "09:57:32")
 // `#define DEBUG_SHOW_TIMESTAMP 2` (default) - printing timestamp relative to
 // program staring time rather than system real time
+// `#define DEBUG_SHOW_TIMESTAMP 3` - like 2, but read from the CPU cycle
+// counter (rdtsc, or cntvct_el0 on ARM64) calibrated to nanoseconds, precise
+// enough to order lines from different threads (e.g. "  0.001234"), the
+// first timestamped line calibrates it, waiting until 2 ms have passed since
+// startup
+// `#define DEBUG_TIMESTAMP_DIGITS 6` (default) - digits after the second for
+// DEBUG_SHOW_TIMESTAMP 3, 6 for microseconds, 9 for nanoseconds
 //
-// `#define DEBUG_SHOW_THREAD_ID 0` (default) - do not print the thread id
-// `#define DEBUG_SHOW_THREAD_ID 1` - print the current thread id
+// `#define DEBUG_TIMESTAMP_COARSE 1` (default) - read the wall clock for
+// DEBUG_SHOW_TIMESTAMP 1 from the coarse (tick resolution, but much cheaper)
+// clock where available (CLOCK_REALTIME_COARSE on Linux)
+// `#define DEBUG_TIMESTAMP_COARSE 0` - always read the precise wall clock
+//
+// `#define DEBUG_SHOW_THREAD_ID 0` (default) - do not print the thread id,
+// debug::set_thread_name() does nothing
+// `#define DEBUG_SHOW_THREAD_ID 1` - print the current thread as a small
+// number, threads are numbered 1, 2, 3... in the order they first print (e.g.
+// "[2]"), name them with debug::set_thread_name() (e.g. "[2:worker]")
 //
 // `#define DEBUG_SHOW_LOCATION 1` (default) - show source location mark before
 // each line of the debug output (e.g. "file.cpp:233")
 // `#define DEBUG_SHOW_LOCATION 0` - do not show the location mark
 //
 // `#define DEBUG_OUTPUT std::cerr <<` (default) - controls where to output the
-// debug strings (must be callable as DEBUG_OUTPUT(str))
+// debug strings (must be callable as DEBUG_OUTPUT(str), str is a std::string
+// reused for the next line, so copy it to keep it)
+// `#define DEBUG_SINKS 0` (default) - always output through DEBUG_OUTPUT
+// `#define DEBUG_SINKS 1` - output through the sink installed at runtime with
+// debug::set_sink() instead (POSIX only), built-in sinks are debug::fd_sink
+// (one write(2) per line), debug::file_sink (lines are coalesced and written
+// with writev(2)), debug::rotating_file_sink (starts a new preallocated file
+// every given size), debug::fanout_sink (writes to several sinks) and
+// debug::mmap_ring_sink (keeps the last lines in a memory-mapped ring file that
+// survives crashes, see debug_ring.cpp)
+//
+// `#define DEBUG_LINE_BUFFER_SIZE 256` (default) - initial capacity of the
+// per-thread reusable buffer each line is formatted into
+// `#define DEBUG_LINE_BUFFER_MAX_RETAINED 65536` (default) - line buffers grown
+// beyond this size are shrunk back after use instead of being kept for reuse
+// `#define DEBUG_STREAM_THRESHOLD 0` (default) - each line is formatted whole
+// before it is output
+// `#define DEBUG_STREAM_THRESHOLD 1048576` - a line growing beyond 1 MiB is
+// output in chunks of about that size while it is still being formatted, so
+// printing a huge value takes bounded memory, lines of other threads wait
+// until the line is complete (cannot be used with DEBUG_JSON, DEBUG_DEFERRED,
+// DEBUG_FLIGHT_RECORDER or DEBUG_COALESCE), converting a line that outgrew
+// it to std::string throws std::length_error, and the line has been output by
+// then
+//
+// `#define DEBUG_ASYNC 0` (default) - output each line synchronously on the
+// thread that calls debug()
+// `#define DEBUG_ASYNC 1` - push each line into a per-thread lock-free ring
+// buffer, a background thread drains all rings into DEBUG_OUTPUT in batches,
+// remaining lines are flushed at exit and before panic (or call debug::flush())
+// `#define DEBUG_ASYNC_RING_SIZE 1024` (default) - number of lines each
+// thread's ring buffer can hold before the DEBUG_ASYNC_FULL_POLICY kicks in
+// `#define DEBUG_ASYNC_FULL_POLICY 1` (default) - block the calling thread
+// until the background thread makes room in a full ring
+// `#define DEBUG_ASYNC_FULL_POLICY 0` - drop the line when the ring is full,
+// the number of dropped lines is reported at exit
+// `#define DEBUG_ASYNC_FLUSH_INTERVAL 10` (default) - milliseconds for the
+// background thread to sleep when there is nothing to output
+//
+// `#define DEBUG_DEFERRED 0` (default) - format each line when debug() is
+// called
+// `#define DEBUG_DEFERRED 1` - only capture the raw bytes of integers, floats,
+// strings and pointers (other types are still formatted eagerly) at the call
+// site, the formatting is done later by the DEBUG_ASYNC background thread
+// `#define DEBUG_DEFERRED_FILE "debug.bin"` - together with DEBUG_DEFERRED,
+// write the captured binary records into this file instead of formatting
+// them, decode it later with debug::deferred_decode (see debug_decode.cpp)
+//
+// `#define DEBUG_FLIGHT_RECORDER 0` (default) - output every line as it comes,
+// debug::dump_flight_recorder() does nothing
+// `#define DEBUG_FLIGHT_RECORDER 64` - output nothing during normal operation,
+// instead each thread keeps its last 64 lines (or DEBUG_DEFERRED records) in a
+// ring preallocated in memory, the lines of all threads are output merged in
+// time order when a check fails, on SIGSEGV, SIGABRT, SIGBUS, SIGFPE and
+// SIGILL, or when debug::dump_flight_recorder() is called, in a signal handler
+// they are written to stderr with write(2) only (DEBUG_DEFERRED records give
+// just their file and line there)
+// `#define DEBUG_FLIGHT_RECORDER_LINE_SIZE 256` (default) - bytes kept for
+// each line by DEBUG_FLIGHT_RECORDER, longer lines end with
+// DEBUG_TRUNCATED_STRING, a line being overwritten while it is dumped is
+// skipped
+//
+// `#define DEBUG_ENABLE_FILES_MATCH 0` (default) - print debug() from all files
+// `#define DEBUG_ENABLE_FILES_MATCH 1` - only print debug() from the files
+// listed in the DEBUG_FILES environment variable (if set), separated by
+// spaces, commas or semicolons, e.g. `DEBUG_FILES="main.cpp src/net/ *.hpp"`
+// (base names or paths, directories ending with '/', or globs), the result is
+// cached per call site
+//
+// `#define DEBUG_CALL_SITE_CONTROL 0` (default) - no runtime control of
+// individual debug() call sites, debug::set_sites() does nothing and
+// debug::call_sites() is empty
+// `#define DEBUG_CALL_SITE_CONTROL 1` - every call site registers itself on
+// its first execution, and can be switched on and off at runtime by rules
+// from the DEBUG_SITES environment variable, the file named by the
+// DEBUG_SITES_FILE environment variable (re-read on SIGHUP, a SIGHUP handler
+// installed before the first debug() is still called) and
+// debug::set_sites, e.g. `DEBUG_SITES="-*.cpp main.cpp -*parse*()"`, list
+// them with debug::call_sites()
+//
+// `#define DEBUG_SAMPLING_SUMMARY 1` (default) - print how many lines each
+// call site has suppressed with debug().every(n), debug().first(n) or
+// debug().rate_per_sec(n) at exit
+// `#define DEBUG_SAMPLING_SUMMARY 0` - do not print the summary
+// `#define DEBUG_CALL_SITE_TABLE_SIZE 4096` (default) - capacity (power of two)
+// of the hash table keeping the per call site state, sites beyond it still
+// work, but are looked up slowly
+//
+// `#define DEBUG_COALESCE 0` (default) - output every line
+// `#define DEBUG_COALESCE 1000` - a line equal to the last line output from
+// the same call site less than 1000 milliseconds ago is only counted, and the
+// count is output as "debug: file.cpp:12: last message repeated 41 times"
+// before the next line from that call site (or at exit)
+//
+// `#define DEBUG_JSON 0` (default) - output each line as plain text
+// `#define DEBUG_JSON 1` - output each line as one JSON object, e.g.
+// {"timestamp":1234,"file":"/src/main.cpp","line":12,"function":"int main()",
+// "args":["x is",42],"message":"x is 42"}, where args holds one JSON value per
+// argument (numbers, booleans and strings as such, ranges and tuples as
+// arrays, where a range over the limit has {"elided":n} in place of the
+// elements it skips, DEBUG_REPR structs as objects, nullopt and null pointers
+// as null, other types as their text, with invalid UTF-8 replaced by U+FFFD),
+// timestamp and thread follow DEBUG_SHOW_TIMESTAMP and DEBUG_SHOW_THREAD_ID,
+// converting to std::string still gives the message
 //
 // `#define DEBUG_PANIC_METHOD 0` - throws an runtime error with debug string as
 // message when assertion failed
@@ -112,6 +236,16 @@
 // `#define DEBUG_RANGE_BRACE "{}"` (default) - controls format for range-like
 // objects (supporting begin(x) and end(x)) in "{1, 2, 3, ...}"
 // `#define DEBUG_RANGE_COMMA ", "` (default) - ditto
+// `#define DEBUG_RANGE_LIMIT 1000` (default) - ranges (and debug::hexdump, or
+// debug::xxd counting bytes) with more elements than this only print the first
+// and last half of them, e.g. "{0, 1, ... (996 more) ..., 998, 999}", override
+// it for one line with `debug().limit(n)`, 0 means no limit
+// `#define DEBUG_MAX_BYTES 0` (default) - no limit on the length of a line
+// `#define DEBUG_MAX_BYTES 65536` - once a line is 64 KiB long, what remains
+// of it is not formatted at all (ranges, tuples, variants and repr() are not
+// entered anymore, strings are cut short), and DEBUG_TRUNCATED_STRING
+// ("... (truncated)" by default) ends it, override it for one line with
+// `debug().max_bytes(n)`, 0 means no limit
 //
 // `#define DEBUG_TUPLE_BRACE "{}"` (default) - controls format for tuple-like
 // objects (supporting std::tuple_size<X>) in "{1, 2, 3}"
@@ -133,7 +267,7 @@
 // `#define DEBUG_HEXADECIMAL_UPPERCASE 0` (default) - print hexadecimal values
 // in lowercase (a-f)
 // `#define DEBUG_HEXADECIMAL_UPPERCASE 1` - print hexadecimal values in
-// uppercase (A-F)
+// uppercase (A-F), escapes in strings (e.g. '\x1b') stay lowercase
 //
 // `#define DEBUG_SUPRESS_NON_ASCII 0` (default) - consider non-ascii characters
 // in std::string as printable (e.g. UTF-8 encoded Chinese characters)
@@ -156,6 +290,10 @@
 // unless nullptr (e.g. 42 for std::shared_ptr<int>)
 // `#define DEBUG_SMART_POINTER_MODE 3` - print smart pointer as both content
 // value and raw pointer address (e.g. 42@0xdeadbeaf)
+// when the content value is printed, an object reached through several smart
+// pointers in one line (or through a cycle) is printed once, with an anchor
+// such as "#2={9, {}}", and then as "<ref #2>" (the objects are numbered in
+// the order they were first printed, an object and its first member are two)
 //
 // `#define DEBUG_NAMESPACE_BEGIN` (default) - expose debug in the global
 // namespace
@@ -175,6 +313,9 @@
 #  define DEBUG_LEVEL 1
 # endif
 #endif
+#ifndef DEBUG_RELEASE_CHECKS
+# define DEBUG_RELEASE_CHECKS 0
+#endif
 #ifndef DEBUG_SHOW_LOCATION
 # define DEBUG_SHOW_LOCATION 1
 #endif
@@ -192,6 +333,50 @@
 #endif
 #ifndef DEBUG_OUTPUT
 # define DEBUG_OUTPUT std::cerr <<
+# define DEBUG_OUTPUT_IS_DEFAULT
+#endif
+#ifndef DEBUG_SINKS
+# define DEBUG_SINKS 0
+#endif
+#ifndef DEBUG_LINE_BUFFER_SIZE
+# define DEBUG_LINE_BUFFER_SIZE 256
+#endif
+#ifndef DEBUG_LINE_BUFFER_MAX_RETAINED
+# define DEBUG_LINE_BUFFER_MAX_RETAINED 65536
+#endif
+#ifndef DEBUG_ASYNC
+# define DEBUG_ASYNC 0
+#endif
+#ifndef DEBUG_ASYNC_RING_SIZE
+# define DEBUG_ASYNC_RING_SIZE 1024
+#endif
+#ifndef DEBUG_ASYNC_FULL_POLICY
+# define DEBUG_ASYNC_FULL_POLICY 1
+#endif
+#ifndef DEBUG_ASYNC_FLUSH_INTERVAL
+# define DEBUG_ASYNC_FLUSH_INTERVAL 10
+#endif
+#ifndef DEBUG_DEFERRED
+# define DEBUG_DEFERRED 0
+#endif
+#if DEBUG_DEFERRED && !DEBUG_ASYNC
+# undef DEBUG_ASYNC
+# define DEBUG_ASYNC 1
+#endif
+#ifndef DEBUG_FLIGHT_RECORDER
+# define DEBUG_FLIGHT_RECORDER 0
+#endif
+#ifndef DEBUG_FLIGHT_RECORDER_LINE_SIZE
+# define DEBUG_FLIGHT_RECORDER_LINE_SIZE 256
+#endif
+#ifndef DEBUG_JSON
+# define DEBUG_JSON 0
+#endif
+#if DEBUG_JSON && DEBUG_DEFERRED
+# error "DEBUG_JSON cannot be used together with DEBUG_DEFERRED"
+#endif
+#ifndef DEBUG_STREAM_THRESHOLD
+# define DEBUG_STREAM_THRESHOLD 0
 #endif
 #ifndef DEBUG_ENABLE_FILES_MATCH
 # define DEBUG_ENABLE_FILES_MATCH 0
@@ -229,6 +414,47 @@
 #ifndef DEBUG_RANGE_COMMA
 # define DEBUG_RANGE_COMMA ", "
 #endif
+#ifndef DEBUG_RANGE_LIMIT
+# define DEBUG_RANGE_LIMIT 1000
+#endif
+#ifndef DEBUG_MAX_BYTES
+# define DEBUG_MAX_BYTES 0
+#endif
+#ifndef DEBUG_TRUNCATED_STRING
+# define DEBUG_TRUNCATED_STRING "... (truncated)"
+#endif
+#ifndef DEBUG_CALL_SITE_TABLE_SIZE
+# define DEBUG_CALL_SITE_TABLE_SIZE 4096
+#endif
+#ifndef DEBUG_CALL_SITE_CONTROL
+# define DEBUG_CALL_SITE_CONTROL 0
+#endif
+#ifndef DEBUG_TIMESTAMP_DIGITS
+# define DEBUG_TIMESTAMP_DIGITS 6
+#endif
+#ifndef DEBUG_TIMESTAMP_COARSE
+# define DEBUG_TIMESTAMP_COARSE 1
+#endif
+#ifndef DEBUG_SAMPLING_SUMMARY
+# define DEBUG_SAMPLING_SUMMARY 1
+#endif
+#ifndef DEBUG_COALESCE
+# define DEBUG_COALESCE 0
+#endif
+#if DEBUG_STREAM_THRESHOLD && (DEBUG_JSON || DEBUG_DEFERRED || \
+                               DEBUG_FLIGHT_RECORDER || DEBUG_COALESCE)
+# error "DEBUG_STREAM_THRESHOLD cannot be used together with DEBUG_JSON, \
+DEBUG_DEFERRED, DEBUG_FLIGHT_RECORDER or DEBUG_COALESCE"
+#endif
+// whether a line may be output in chunks while it is formatted (past
+// DEBUG_STREAM_THRESHOLD, or a large debug::xxd), not when it is kept whole
+// (a coalesced line is compared whole before it is output)
+#if !DEBUG_JSON && !DEBUG_DEFERRED && !DEBUG_FLIGHT_RECORDER && \
+    !DEBUG_COALESCE
+# define DEBUG_LINE_CHUNKS 1
+#else
+# define DEBUG_LINE_CHUNKS 0
+#endif
 #ifndef DEBUG_TUPLE_BRACE
 # define DEBUG_TUPLE_BRACE "{}"
 #endif
@@ -286,19 +512,35 @@
 #ifndef DEBUG_SHOW_TIMESTAMP
 # define DEBUG_SHOW_TIMESTAMP 2
 #endif
+#ifndef DEBUG_SHOW_THREAD_ID
+# define DEBUG_SHOW_THREAD_ID 0
+#endif
 #ifdef DEBUG_CLASS_NAME
 # define debug DEBUG_CLASS_NAME
 #endif
 #if DEBUG_LEVEL
 # include <cstdint>
 # include <cstdlib>
+# include <cstring>
 # include <iomanip>
 # include <iostream>
 # include <limits>
 # include <system_error>
 # if DEBUG_SHOW_SOURCE_CODE_LINE
 #  include <fstream>
+#  include <shared_mutex>
 #  include <unordered_map>
+#  include <vector>
+#  if defined(__has_include)
+#   if (defined(__unix__) || defined(__APPLE__)) && \
+       __has_include(<sys/mman.h>)
+#    include <fcntl.h>
+#    include <sys/mman.h>
+#    include <sys/stat.h>
+#    include <unistd.h>
+#    define DEBUG_HAS_MMAP
+#   endif
+#  endif
 # endif
 # ifndef DEBUG_SOURCE_LOCATION
 #  if __cplusplus >= 202002L
@@ -324,12 +566,15 @@
 #   endif
 #  endif
 # endif
+# include <algorithm>
+# include <iterator>
 # include <memory>
 # include <sstream>
 # include <string>
 # include <type_traits>
 # include <typeinfo>
 # include <utility>
+# include <vector>
 # ifndef DEBUG_CUSTOM_DEMANGLE
 #  ifndef DEBUG_HAS_CXXABI_H
 #   if defined(__has_include)
@@ -343,9 +588,11 @@
 #  endif
 # endif
 # if DEBUG_SHOW_TIMESTAMP == 1
+#  include <ctime>
 #  if defined(__has_include)
 #   if defined(__unix__) && __has_include(<sys/time.h>)
 #    include <sys/time.h>
+#    include <time.h>
 #    define DEBUG_HAS_SYS_TIME_H
 #   endif
 #  endif
@@ -354,15 +601,109 @@
 #  endif
 # elif DEBUG_SHOW_TIMESTAMP == 2
 #  include <chrono>
+# elif DEBUG_SHOW_TIMESTAMP == 3
+#  include <chrono>
+#  if defined(_MSC_VER) && !defined(__clang__)
+#   include <intrin.h>
+#  elif defined(__x86_64__) || defined(__i386__)
+#   include <x86intrin.h>
+#  endif
 # endif
 # if DEBUG_SHOW_THREAD_ID
+#  include <vector>
+# endif
+# if DEBUG_DEFERRED
+#  include <cstring>
+#  include <vector>
+#  ifdef DEBUG_DEFERRED_FILE
+#   include <cstdio>
+#   include <map>
+#   include <tuple>
+#  endif
+# endif
+# include <atomic>
+# include <chrono>
+# include <mutex>
+# if DEBUG_CALL_SITE_CONTROL
+#  include <csignal>
+#  include <cstring>
+#  include <fstream>
+#  include <vector>
+# endif
+# if DEBUG_ENABLE_FILES_MATCH
+#  include <cstring>
+#  include <unordered_set>
+#  include <vector>
+# endif
+# if DEBUG_ASYNC
+#  include <condition_variable>
+#  include <thread>
+#  include <vector>
+# endif
+# if DEBUG_FLIGHT_RECORDER
+#  include <cerrno>
+#  include <csignal>
+#  if defined(_WIN32)
+#   include <io.h>
+#  else
+#   include <unistd.h>
+#  endif
+# endif
+# if DEBUG_STREAM_THRESHOLD
+#  include <thread>
+# endif
+# if DEBUG_SINKS
+#  if !defined(__unix__) && !defined(__APPLE__)
+#   error "DEBUG_SINKS requires a POSIX system"
+#  endif
+#  include <cerrno>
+#  include <cstddef>
+#  include <cstdio>
+#  include <cstring>
+#  include <fcntl.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#  include <sys/uio.h>
 #  include <thread>
+#  include <unistd.h>
+#  include <vector>
 # endif
 # if defined(__has_include)
 #  if __has_include(<variant>)
 #   include <variant>
 #  endif
 # endif
+# ifndef DEBUG_HAS_SSE2
+#  if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64) || \
+      (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#   define DEBUG_HAS_SSE2 1
+#  else
+#   define DEBUG_HAS_SSE2 0
+#  endif
+# endif
+# ifndef DEBUG_HAS_AVX2
+#  if DEBUG_HAS_SSE2 && defined(__AVX2__)
+#   define DEBUG_HAS_AVX2 1
+#  else
+#   define DEBUG_HAS_AVX2 0
+#  endif
+# endif
+# if DEBUG_HAS_AVX2
+#  include <immintrin.h>
+# elif DEBUG_HAS_SSE2
+#  include <emmintrin.h>
+# endif
+# if DEBUG_HAS_SSE2 && defined(_MSC_VER) && !defined(__clang__)
+#  include <intrin.h>
+# endif
+# if __cplusplus >= 201703L && defined(__has_include)
+#  if __has_include(<charconv>)
+#   include <charconv>
+#   if __cpp_lib_to_chars
+#    define DEBUG_HAS_TO_CHARS
+#   endif
+#  endif
+# endif
 # ifndef DEBUG_STRING_VIEW
 #  if defined(__has_include)
 #   if __cplusplus >= 201703L
@@ -480,10 +821,107 @@ private:
         return debug_special_void();
     }
 
+    static bool debug_needs_escape(char c, char quote) noexcept {
+        return (c >= 0 && c < 0x20) || c == 0x7F || c == '\\' || c == quote
+# if DEBUG_SUPRESS_NON_ASCII
+               || static_cast<unsigned char>(c) >= 0x80
+# endif
+            ;
+    }
+# if DEBUG_HAS_SSE2
+    static unsigned debug_ctz(std::uint32_t x) noexcept {
+#  if defined(_MSC_VER) && !defined(__clang__)
+        unsigned long i;
+        _BitScanForward(&i, x);
+        return static_cast<unsigned>(i);
+#  else
+        return static_cast<unsigned>(__builtin_ctz(x));
+#  endif
+    }
+# endif
+
+    // returns the first byte that debug_needs_escape, or end if none
+    static char const *debug_find_escape(char const *p, char const *end,
+                                         char quote) noexcept {
+# if DEBUG_HAS_AVX2
+        {
+            __m256i const ctrl = _mm256_set1_epi8(0x20);
+            __m256i const del = _mm256_set1_epi8(0x7F);
+            __m256i const bs = _mm256_set1_epi8('\\');
+            __m256i const qt = _mm256_set1_epi8(quote);
+            while (end - p >= 32) {
+                __m256i x =
+                    _mm256_loadu_si256(reinterpret_cast<__m256i const *>(p));
+                // signed compare, so bytes >= 0x80 are "less than 0x20" too
+                __m256i m = _mm256_cmpgt_epi8(ctrl, x);
+#  if !DEBUG_SUPRESS_NON_ASCII
+                m = _mm256_andnot_si256(
+                    _mm256_cmpgt_epi8(_mm256_setzero_si256(), x), m);
+#  endif
+                m = _mm256_or_si256(m, _mm256_cmpeq_epi8(x, del));
+                m = _mm256_or_si256(m, _mm256_cmpeq_epi8(x, bs));
+                m = _mm256_or_si256(m, _mm256_cmpeq_epi8(x, qt));
+                auto bits = static_cast<std::uint32_t>(_mm256_movemask_epi8(m));
+                if (bits) {
+                    return p + debug_ctz(bits);
+                }
+                p += 32;
+            }
+        }
+# endif
+# if DEBUG_HAS_SSE2
+        {
+            __m128i const ctrl = _mm_set1_epi8(0x20);
+            __m128i const del = _mm_set1_epi8(0x7F);
+            __m128i const bs = _mm_set1_epi8('\\');
+            __m128i const qt = _mm_set1_epi8(quote);
+            while (end - p >= 16) {
+                __m128i x =
+                    _mm_loadu_si128(reinterpret_cast<__m128i const *>(p));
+                // signed compare, so bytes >= 0x80 are "less than 0x20" too
+                __m128i m = _mm_cmplt_epi8(x, ctrl);
+#  if !DEBUG_SUPRESS_NON_ASCII
+                m = _mm_andnot_si128(_mm_cmplt_epi8(x, _mm_setzero_si128()), m);
+#  endif
+                m = _mm_or_si128(m, _mm_cmpeq_epi8(x, del));
+                m = _mm_or_si128(m, _mm_cmpeq_epi8(x, bs));
+                m = _mm_or_si128(m, _mm_cmpeq_epi8(x, qt));
+                auto bits = static_cast<std::uint32_t>(_mm_movemask_epi8(m));
+                if (bits) {
+                    return p + debug_ctz(bits);
+                }
+                p += 16;
+            }
+        }
+# endif
+        for (; p != end; ++p) {
+            if (debug_needs_escape(*p, quote)) {
+                break;
+            }
+        }
+        return p;
+    }
+
     static void debug_quotes(std::ostream &oss, DEBUG_STRING_VIEW sv,
                              char quote) {
         oss << quote;
-        for (char c: sv) {
+        char const *p = sv.data();
+        char const *end = p + sv.size();
+        std::size_t left = debug_bytes_left(oss);
+        if (sv.size() > left) {
+            DEBUG_UNLIKELY {
+                end = p + left;
+            }
+        }
+        while (p != end) {
+            char const *q = debug_find_escape(p, end, quote);
+            if (q != p) {
+                oss.write(p, q - p);
+            }
+            if (q == end) {
+                break;
+            }
+            char c = *q;
             switch (c) {
             case '\n': oss << "\\n"; break;
             case '\r': oss << "\\r"; break;
@@ -491,29 +929,26 @@ private:
             case '\\': oss << "\\\\"; break;
             case '\0': oss << "\\0"; break;
             default:
-                if ((c >= 0 && c < 0x20) || c == 0x7F
-# if DEBUG_SUPRESS_NON_ASCII
-                    || (static_cast<unsigned char>(c) >= 0x80)
-# endif
-                ) {
-                    auto f = oss.flags();
-                    oss << "\\x" << std::hex << std::setfill('0')
-                        << std::setw(2) << static_cast<int>(c)
-# if DEBUG_HEXADECIMAL_UPPERCASE
-                        << std::uppercase
-# endif
-                        ;
-                    oss.flags(f);
+                if (c == quote) {
+                    char esc[2] = {'\\', c};
+                    oss.write(esc, sizeof(esc));
                 } else {
-                    if (c == quote) {
-                        oss << '\\';
-                    }
-                    oss << c;
+                    // escapes stay lowercase with DEBUG_HEXADECIMAL_UPPERCASE
+                    static char const hex[] = "0123456789abcdef";
+                    auto u = static_cast<unsigned char>(c);
+                    char esc[4] = {'\\', 'x', hex[u >> 4], hex[u & 15]};
+                    oss.write(esc, sizeof(esc));
                 }
                 break;
             }
+            p = q + 1;
         }
         oss << quote;
+        if (end != sv.data() + sv.size()) {
+            DEBUG_UNLIKELY {
+                debug_bytes_left(oss);
+            }
+        }
     }
 
     template <class T>
@@ -547,6 +982,14 @@ public:
             debug_format(os, value);
             return *this;
         }
+
+        // the line is out of DEBUG_MAX_BYTES (counting the separator and
+        // name about to be written), no more members are printed
+        bool full(char const *separator, char const *name) const {
+            return debug_bytes_left(
+                       os, std::char_traits<char>::length(separator) +
+                               std::char_traits<char>::length(name)) == 0;
+        }
     };
 
 private:
@@ -645,9 +1088,59 @@ private:
     DEBUG_CON(enum, std::is_enum<T>::value);
     template <class T, class = void>
     struct debug_format_trait;
+# ifdef DEBUG_HAS_TO_CHARS
+    // std::to_chars output equals operator<< only for default stream state,
+    // user streams (e.g. debug_formatter{std::cout}) may have std::hex etc.
+    static bool debug_to_chars_ok(std::ostream &oss) noexcept {
+        return oss.flags() == (std::ios_base::dec | std::ios_base::skipws) &&
+               oss.width() == 0;
+    }
+# endif
+
+    struct debug_line_stream;
+
+    // the debug_line_stream that oss is, stored in the stream itself so that
+    // nested ranges and repr() find it too, null for other streams
+    static int debug_line_stream_index() {
+        static int const index = std::ios_base::xalloc();
+        return index;
+    }
+
+    static debug_line_stream *debug_line_stream_of(std::ostream &oss) {
+        return static_cast<debug_line_stream *>(
+            oss.pword(debug_line_stream_index()));
+    }
+
+    // the bytes of the line left before DEBUG_MAX_BYTES (or max_bytes(n)) is
+    // reached, ends the line with DEBUG_TRUNCATED_STRING once it is reached,
+    // callers about to write a separator pass its size, so that it is not
+    // written when nothing would fit after it
+    static std::size_t debug_bytes_left(std::ostream &oss,
+                                        std::size_t separator = 0) {
+        debug_line_stream *line = debug_line_stream_of(oss);
+        if (!line || !line->max_bytes) {
+            return static_cast<std::size_t>(-1);
+        }
+        std::size_t written = line->buf.written() + separator;
+        if (written < line->max_bytes) {
+            DEBUG_LIKELY {
+                return line->max_bytes - written;
+            }
+        }
+        if (!line->truncated) {
+            line->truncated = true;
+            oss << DEBUG_TRUNCATED_STRING;
+        }
+        return 0;
+    }
 
     template <class T>
     static void debug_format(std::ostream &oss, T const &t) {
+        if (debug_bytes_left(oss) == 0) {
+            DEBUG_UNLIKELY {
+                return;
+            }
+        }
         debug_format_trait<T>()(oss, t);
     }
 
@@ -740,6 +1233,39 @@ private:
                !debug_cond_unicode_char<T>::value &&
                debug_cond_integral_unsigned<T>::value>::type> {
         void operator()(std::ostream &oss, T const &t) const {
+# ifdef DEBUG_HAS_TO_CHARS
+            if (debug_to_chars_ok(oss)) {
+                DEBUG_LIKELY {
+                    char digits[sizeof(std::uintmax_t) * 2];
+                    auto res = std::to_chars(
+                        digits, digits + sizeof(digits),
+                        static_cast<std::uintmax_t>(
+                            static_cast<typename std::make_unsigned<T>::type>(
+                                t)),
+                        16);
+                    std::size_t n =
+                        static_cast<std::size_t>(res.ptr - digits);
+                    char buf[2 + sizeof(digits)] = {'0', 'x'};
+                    char *p = buf + 2;
+#  if DEBUG_UNSIGNED_AS_HEXADECIMAL >= 2
+                    for (std::size_t i = n; i < sizeof(T) * 2; ++i) {
+                        *p++ = '0';
+                    }
+#  endif
+                    for (std::size_t i = 0; i < n; ++i) {
+#  if DEBUG_HEXADECIMAL_UPPERCASE
+                        *p++ = digits[i] >= 'a' ? static_cast<char>(
+                                                      digits[i] - 'a' + 'A')
+                                                : digits[i];
+#  else
+                        *p++ = digits[i];
+#  endif
+                    }
+                    oss.write(buf, p - buf);
+                    return;
+                }
+            }
+# endif
             auto f = oss.flags();
             oss << "0x" << std::hex << std::setfill('0')
 # if DEBUG_UNSIGNED_AS_HEXADECIMAL >= 2
@@ -764,6 +1290,20 @@ private:
                !debug_cond_integral_unsigned<T>::value &&
                debug_cond_integral<T>::value>::type> {
         void operator()(std::ostream &oss, T const &t) const {
+# ifdef DEBUG_HAS_TO_CHARS
+            if (debug_to_chars_ok(oss)) {
+                DEBUG_LIKELY {
+                    char buf[std::numeric_limits<std::uintmax_t>::digits10 + 3];
+                    auto res = std::to_chars(
+                        buf, buf + sizeof(buf),
+                        static_cast<typename std::conditional<
+                            std::is_signed<T>::value, std::intmax_t,
+                            std::uintmax_t>::type>(t));
+                    oss.write(buf, res.ptr - buf);
+                    return;
+                }
+            }
+# endif
             oss << static_cast<typename std::conditional<
                 std::is_signed<T>::value, std::intmax_t, std::uintmax_t>::type>(
                 t);
@@ -780,6 +1320,23 @@ private:
                !debug_cond_integral<T>::value &&
                debug_cond_floating_point<T>::value>::type> {
         void operator()(std::ostream &oss, T const &t) const {
+# ifdef DEBUG_HAS_TO_CHARS
+            if (debug_to_chars_ok(oss)) {
+                DEBUG_LIKELY {
+                    char buf[std::numeric_limits<T>::max_exponent10 +
+                             std::numeric_limits<T>::digits10 + 8];
+                    auto res = std::to_chars(buf, buf + sizeof(buf), t,
+                                             std::chars_format::fixed,
+                                             std::numeric_limits<T>::digits10);
+                    if (res.ec == std::errc()) {
+                        DEBUG_LIKELY {
+                            oss.write(buf, res.ptr - buf);
+                            return;
+                        }
+                    }
+                }
+            }
+# endif
             auto f = oss.flags();
             oss << std::fixed
                 << std::setprecision(std::numeric_limits<T>::digits10) << t;
@@ -787,6 +1344,130 @@ private:
         }
     };
 
+    // the objects behind smart pointers already printed in the line, keyed
+    // by address and type (a pointer to the first member of an object is
+    // another object) in an open-addressing table, numbered in the order
+    // they were first printed, so that each is printed once
+    struct debug_ref_table {
+        struct slot {
+            void const volatile *key;
+            std::type_info const *type;
+            std::size_t id;
+            // where it was first printed, in bytes of the line
+            std::size_t offset;
+            bool anchored;
+        };
+
+        std::vector<slot> slots;
+        std::size_t count = 0;
+
+        static std::size_t hash(void const volatile *p,
+                                std::type_info const *type) noexcept {
+            auto h = static_cast<std::uint64_t>(
+                         reinterpret_cast<std::uintptr_t>(p)) ^
+                     static_cast<std::uint64_t>(
+                         reinterpret_cast<std::uintptr_t>(type) >> 4);
+            return static_cast<std::size_t>((h * 0x9E3779B97F4A7C15u) >> 32);
+        }
+
+        void insert(slot const &s) noexcept {
+            std::size_t mask = slots.size() - 1;
+            std::size_t i = hash(s.key, s.type) & mask;
+            while (slots[i].key) {
+                i = (i + 1) & mask;
+            }
+            slots[i] = s;
+        }
+
+        // the entry of p if it was printed before, records it as printed at
+        // offset and returns nullptr otherwise
+        slot *visit(void const volatile *p, std::type_info const &type,
+                    std::size_t offset) {
+            if (slots.empty()) {
+                slots.resize(16, slot{nullptr, nullptr, 0, 0, false});
+            } else if ((count + 1) * 2 > slots.size()) {
+                std::vector<slot> old(slots.size() * 2,
+                                      slot{nullptr, nullptr, 0, 0, false});
+                old.swap(slots);
+                for (slot const &s: old) {
+                    if (s.key) {
+                        insert(s);
+                    }
+                }
+            }
+            std::size_t mask = slots.size() - 1;
+            for (std::size_t i = hash(p, &type) & mask;; i = (i + 1) & mask) {
+                if (!slots[i].key) {
+                    slots[i] = slot{p, &type, ++count, offset, false};
+                    return nullptr;
+                }
+                if (slots[i].key == p && *slots[i].type == type) {
+                    return &slots[i];
+                }
+            }
+        }
+
+        // n bytes were inserted before the text of the entries printed
+        // after s (at the same offset, those are nested inside s)
+        void shift(slot const &s, std::size_t n) noexcept {
+            for (slot &o: slots) {
+                if (o.key && (o.offset > s.offset ||
+                              (o.offset == s.offset && o.id > s.id))) {
+                    o.offset += n;
+                }
+            }
+        }
+
+        void clear() {
+            if (count) {
+                DEBUG_UNLIKELY {
+                    if (slots.size() > 1024) {
+                        std::vector<slot>().swap(slots);
+                    } else {
+                        std::fill(slots.begin(), slots.end(),
+                                  slot{nullptr, nullptr, 0, 0, false});
+                    }
+                    count = 0;
+                }
+            }
+        }
+    };
+
+    // writes "#n=" where s was first printed, unless that part of the line
+    // has been output already (a streamed line)
+    static void debug_format_anchor(debug_line_stream &line,
+                                    debug_ref_table::slot &s) {
+        char mark[24];
+        char *p = mark + sizeof(mark);
+        *--p = '=';
+        for (std::size_t id = s.id; id; id /= 10) {
+            *--p = static_cast<char>('0' + id % 10);
+        }
+        *--p = '#';
+        auto n = static_cast<std::size_t>(mark + sizeof(mark) - p);
+        if (line.buf.insert(s.offset, p, n)) {
+            line.refs.shift(s, n);
+        }
+        s.anchored = true;
+    }
+
+    // an object printed again is referred to as <ref #n>, and its first
+    // print gets the #n= anchor then
+    template <class T>
+    static void debug_format_pointee(std::ostream &oss, T const &t) {
+        if (debug_line_stream *line = debug_line_stream_of(oss)) {
+            if (debug_ref_table::slot *s = line->refs.visit(
+                    std::addressof(t), typeid(T), line->buf.written())) {
+                if (!s->anchored) {
+                    debug_format_anchor(*line, *s);
+                }
+                oss << "<ref #" << s->id << '>';
+                return;
+            }
+        }
+        debug_format(oss, t);
+    }
+
     template <class T>
     struct debug_format_trait<
         T, typename std::enable_if<
@@ -801,7 +1482,7 @@ private:
             auto const *p = t.get();
             if (p != nullptr) {
 # if DEBUG_SMART_POINTER_MODE == 1
-                debug_format(oss, *p);
+                debug_format_pointee(oss, *p);
 # elif DEBUG_SMART_POINTER_MODE == 2
                 auto f = oss.flags();
                 oss << DEBUG_POINTER_HEXADECIMAL_PREFIX << std::hex
@@ -814,7 +1495,7 @@ private:
                     static_cast<void const volatile *>(p));
                 oss.flags(f);
 # else
-                debug_format(oss, *p);
+                debug_format_pointee(oss, *p);
                 oss << DEBUG_SMART_POINTER_AT;
                 auto f = oss.flags();
                 oss << DEBUG_POINTER_HEXADECIMAL_PREFIX << std::hex
@@ -900,6 +1581,149 @@ private:
         }
     };
 
+    // the element budget of the line being formatted, stored in the stream
+    // itself so that nested ranges and repr() see it too, 0 means default
+    static int debug_range_limit_index() {
+        static int const index = std::ios_base::xalloc();
+        return index;
+    }
+
+    static std::size_t debug_range_limit(std::ostream &oss) {
+        long limit = oss.iword(debug_range_limit_index());
+        return limit ? static_cast<std::size_t>(limit - 1)
+                     : static_cast<std::size_t>(DEBUG_RANGE_LIMIT);
+    }
+
+    static void debug_range_elision(std::ostream &oss, std::size_t more) {
+        char buf[32];
+        char *p = buf + sizeof(buf);
+        do {
+            *--p = static_cast<char>('0' + more % 10);
+            more /= 10;
+        } while (more);
+        oss << "... (";
+        oss.write(p, buf + sizeof(buf) - p);
+        oss << " more) ...";
+    }
+
+    template <class It, class = void>
+    struct debug_iterator_category {
+        using type = std::input_iterator_tag;
+    };
+
+    template <class It>
+    struct debug_iterator_category<
+        It, typename debug_void<
+                typename std::iterator_traits<It>::iterator_category>::type> {
+        using type = typename std::conditional<
+            std::is_base_of<
+                std::forward_iterator_tag,
+                typename std::iterator_traits<It>::iterator_category>::value,
+            std::forward_iterator_tag, std::input_iterator_tag>::type;
+    };
+
+    // prints [b, e) with `each`, eliding the middle when there are more
+    // elements than the budget: random access iterators jump over it, other
+    // forward iterators walk over it without formatting, and single pass
+    // ranges only print the head
+    template <class It, class Each>
+    static void debug_range_elided(std::ostream &oss, It b, It e,
+                                   char const *sep, Each const &each,
+                                   std::forward_iterator_tag) {
+        std::size_t limit = debug_range_limit(oss);
+        std::size_t n = limit ? static_cast<std::size_t>(std::distance(b, e))
+                              : 0;
+        if (n <= limit) {
+            DEBUG_LIKELY {
+                debug_range_elided(oss, b, e, sep, each,
+                                   std::input_iterator_tag());
+                return;
+            }
+        }
+        std::size_t head = (limit + 1) / 2;
+        std::size_t tail = limit / 2;
+        std::size_t sep_size = std::char_traits<char>::length(sep);
+        for (std::size_t i = 0; i < head; ++i, ++b) {
+            if (debug_bytes_left(oss, i ? sep_size : 0) == 0) {
+                DEBUG_UNLIKELY {
+                    return;
+                }
+            }
+            if (i) {
+                oss << sep;
+            }
+            each(oss, *b);
+        }
+        if (debug_bytes_left(oss, head ? sep_size : 0) == 0) {
+            DEBUG_UNLIKELY {
+                return;
+            }
+        }
+        std::advance(b, static_cast<typename std::iterator_traits<
+                                It>::difference_type>(n - head - tail));
+        if (head) {
+            oss << sep;
+        }
+        debug_range_elision(oss, n - head - tail);
+        for (; b != e; ++b) {
+            if (debug_bytes_left(oss, sep_size) == 0) {
+                DEBUG_UNLIKELY {
+                    return;
+                }
+            }
+            oss << sep;
+            each(oss, *b);
+        }
+    }
+
+    template <class It, class Ite, class Each>
+    static void debug_range_elided(std::ostream &oss, It b, Ite e,
+                                   char const *sep, Each const &each,
+                                   std::input_iterator_tag) {
+        std::size_t limit = debug_range_limit(oss);
+        std::size_t sep_size = std::char_traits<char>::length(sep);
+        std::size_t i = 0;
+        for (; b != e; ++b, ++i) {
+            if (debug_bytes_left(oss, i ? sep_size : 0) == 0) {
+                DEBUG_UNLIKELY {
+                    return;
+                }
+            }
+            if (i == limit && limit) {
+                DEBUG_UNLIKELY {
+                    std::size_t more = 0;
+                    for (; b != e; ++b) {
+                        ++more;
+                    }
+                    oss << sep;
+                    debug_range_elision(oss, more);
+                    return;
+                }
+            }
+            if (i) {
+                oss << sep;
+            }
+            each(oss, *b);
+        }
+    }
+
+    template <class It, class Ite, class Each>
+    static void debug_range_elided(std::ostream &oss, It b, Ite e,
+                                   char const *sep, Each const &each) {
+        using forward = typename debug_iterator_category<It>::type;
+        using category =
+            typename std::conditional<std::is_same<It, Ite>::value, forward,
+                                      std::input_iterator_tag>::type;
+        debug_range_elided(oss, b, e, sep, each, category());
+    }
+
+    struct debug_format_each {
+        template <class U>
+        void operator()(std::ostream &oss, U &&u) const {
+            debug_format(oss, std::forward<U>(u));
+        }
+    };
+
     template <class T>
     struct debug_format_trait<
         T, typename std::enable_if<
@@ -917,16 +1741,8 @@ private:
                debug_cond_is_range<T>::value>::type> {
         void operator()(std::ostream &oss, T const &t) const {
             oss << DEBUG_RANGE_BRACE[0];
-            bool add_comma = false;
-            auto b = std::begin(t);
-            auto e = std::end(t);
-            for (auto it = b; it != e; ++it) {
-                if (add_comma) {
-                    oss << DEBUG_RANGE_COMMA;
-                }
-                add_comma = true;
-                debug_format(oss, std::forward<decltype(*it)>(*it));
-            }
+            debug_range_elided(oss, std::begin(t), std::end(t),
+                               DEBUG_RANGE_COMMA, debug_format_each());
             oss << DEBUG_RANGE_BRACE[1];
         }
     };
@@ -974,6 +1790,12 @@ private:
         template <class Arg>
         void call(Arg &&arg) const {
             if (add_comma) {
+                if (debug_bytes_left(oss, std::char_traits<char>::length(
+                                              DEBUG_TUPLE_COMMA)) == 0) {
+                    DEBUG_UNLIKELY {
+                        return;
+                    }
+                }
                 oss << DEBUG_TUPLE_COMMA;
             }
             add_comma = true;
@@ -1302,47 +2124,2598 @@ private:
         }
     };
 
-    std::ostringstream oss;
+# if DEBUG_STREAM_THRESHOLD
+    // held by the thread streaming out a line, other threads wait for it
+    // before writing, while writers outside it are counted, so that the
+    // owner only starts once they are done
+    struct debug_stream_reservation {
+        std::mutex mutex;
+        std::atomic<bool> held{false};
+        std::atomic<std::size_t> writers{0};
+    };
 
-    enum {
-        silent = 0,
-        print = 1,
-        panic = 2,
-        supress = 3,
-    } state;
+    static debug_stream_reservation &debug_stream_instance() {
+        static debug_stream_reservation *r = new debug_stream_reservation();
+        return *r;
+    }
 
-    DEBUG_SOURCE_LOCATION loc;
-# if DEBUG_SHOW_TIMESTAMP == 2
-#  if __cpp_inline_variables
-    static inline std::chrono::steady_clock::time_point const tp0 =
-        std::chrono::steady_clock::now();
-#  endif
-# endif
-    debug &add_location_marks() {
+    // how many lines this thread is streaming, more than one when a repr()
+    // prints a streamed line of its own while the outer one is streaming
+    static std::size_t &debug_stream_owner() noexcept {
+        static thread_local std::size_t owner = 0;
+        return owner;
+    }
+
+    struct debug_stream_writer {
+        debug_stream_reservation &r;
+        bool counted = true;
+
+        explicit debug_stream_writer(debug_stream_reservation &res)
+            : r(res) {
+            r.writers.fetch_add(1);
+            if (r.held.load()) {
+                DEBUG_UNLIKELY {
+                    r.writers.fetch_sub(1);
+                    counted = false;
+                    r.mutex.lock();
+                }
+            }
+        }
+
+        debug_stream_writer(debug_stream_writer &&) = delete;
+
+        ~debug_stream_writer() {
+            if (counted) {
+                r.writers.fetch_sub(1, std::memory_order_release);
+            } else {
+                r.mutex.unlock();
+            }
+        }
+    };
+
+# endif
+# if DEBUG_LINE_CHUNKS
+    // called on the first chunk of a line, the lines this thread queued
+    // before must go out first
+    static void debug_stream_begin() {
+#  if DEBUG_STREAM_THRESHOLD
+        if (debug_stream_owner()) {
+            ++debug_stream_owner();
+            return;
+        }
+#  endif
+#  if DEBUG_ASYNC
+        flush();
+#  endif
+#  if DEBUG_STREAM_THRESHOLD
+        debug_stream_reservation &r = debug_stream_instance();
+        r.mutex.lock();
+        r.held.store(true);
+        while (r.writers.load() != 0) {
+            std::this_thread::yield();
+        }
+        debug_stream_owner() = 1;
+#  endif
+    }
+
+    // outputs the rest of the line, and lets other threads write again
+    static void debug_stream_end(char const *data, std::size_t size) {
+#  if DEBUG_STREAM_THRESHOLD
+        struct release {
+            ~release() {
+                if (--debug_stream_owner() != 0) {
+                    return;
+                }
+                debug_stream_reservation &r = debug_stream_instance();
+                r.held.store(false, std::memory_order_release);
+                r.mutex.unlock();
+            }
+        } guard;
+#  endif
+        debug_output(data, size);
+    }
+
+# endif
+    static void debug_output(char const *data, std::size_t size) {
+# if DEBUG_STREAM_THRESHOLD
+        if (!debug_stream_owner()) {
+            DEBUG_LIKELY {
+                debug_stream_writer writer(debug_stream_instance());
+                debug_output_unreserved(data, size);
+                return;
+            }
+        }
+# endif
+        debug_output_unreserved(data, size);
+    }
+
+    static void debug_output_unreserved(char const *data, std::size_t size) {
+# if DEBUG_SINKS
+        debug_sink_pin pin;
+        if (sink *s = debug_sink_current().load()) {
+            s->write(data, size);
+            return;
+        }
+# endif
+# ifdef DEBUG_OUTPUT_IS_DEFAULT
+        std::cerr.write(data, static_cast<std::streamsize>(size));
+# else
+        debug_output_custom(data, size);
+# endif
+    }
+# ifndef DEBUG_OUTPUT_IS_DEFAULT
+
+    // the std::string handed to a custom DEBUG_OUTPUT, one per thread and
+    // reused for every line, trivially destructible like the line pool
+    static std::string *&debug_output_string() noexcept {
+        static thread_local std::string *str = nullptr;
+        return str;
+    }
+
+    // marks the string as taken, or gone with its thread
+    static std::string *debug_dead_output_string() noexcept {
+        return reinterpret_cast<std::string *>(&debug_output_string());
+    }
+
+    struct debug_output_string_holder {
+        std::string str;
+
+        debug_output_string_holder() noexcept {
+            debug_output_string() = &str;
+        }
+
+        ~debug_output_string_holder() {
+            debug_output_string() = debug_dead_output_string();
+        }
+    };
+
+    // gives the string back once DEBUG_OUTPUT returns (or throws)
+    struct debug_output_string_lease {
+        std::string *&slot;
+        std::string *str;
+
+        ~debug_output_string_lease() {
+            if (str->capacity() > DEBUG_LINE_BUFFER_MAX_RETAINED) {
+                DEBUG_UNLIKELY {
+                    std::string().swap(*str);
+                }
+            }
+            slot = str;
+        }
+    };
+
+    static void debug_output_custom(char const *data, std::size_t size) {
+        std::string *&slot = debug_output_string();
+        if (!slot) {
+            DEBUG_UNLIKELY {
+                static thread_local debug_output_string_holder holder;
+                (void)holder;
+            }
+        }
+        if (slot != debug_dead_output_string()) {
+            DEBUG_LIKELY {
+                // a DEBUG_OUTPUT that prints with debug() gets a copy
+                debug_output_string_lease lease{slot, slot};
+                slot = debug_dead_output_string();
+                lease.str->assign(data, size);
+                DEBUG_OUTPUT(*lease.str);
+                return;
+            }
+        }
+        DEBUG_OUTPUT(std::string(data, size));
+    }
+# endif
+
+    struct debug_line_buffer : std::streambuf {
+        std::string storage;
+# if DEBUG_LINE_CHUNKS
+        // set for lines that may be output in chunks, streamed once the
+        // first chunk is out (and the stream reservation is held)
+        bool streaming = false;
+        bool streamed = false;
+        std::size_t flushed = 0;
+# endif
+
+        debug_line_buffer() : storage(DEBUG_LINE_BUFFER_SIZE, '\0') {
+            reset();
+        }
+
+        void reset() {
+            setp(&storage[0], &storage[0] + storage.size());
+        }
+
+        char const *data() const noexcept {
+            return pbase();
+        }
+
+        char *data() noexcept {
+            return pbase();
+        }
+
+        std::size_t size() const noexcept {
+            return static_cast<std::size_t>(pptr() - pbase());
+        }
+
+        // bytes of the line so far, including the chunks already output
+        std::size_t written() const noexcept {
+# if DEBUG_LINE_CHUNKS
+            return flushed + size();
+# else
+            return size();
+# endif
+        }
+
+        void advance(std::size_t n) {
+            while (n > static_cast<std::size_t>(
+                           std::numeric_limits<int>::max())) {
+                pbump(std::numeric_limits<int>::max());
+                n -= static_cast<std::size_t>(std::numeric_limits<int>::max());
+            }
+            pbump(static_cast<int>(n));
+        }
+
+        void grow(std::size_t n) {
+            std::size_t used = size();
+            std::size_t cap = storage.size() * 2;
+            if (cap < used + n) {
+                cap = used + n;
+            }
+            storage.resize(cap);
+            reset();
+            advance(used);
+        }
+
+        // inserts s at the given offset in bytes of the line, false if that
+        // part of the line has been output already
+        bool insert(std::size_t offset, char const *s, std::size_t n) {
+# if DEBUG_LINE_CHUNKS
+            if (offset < flushed) {
+                return false;
+            }
+            offset -= flushed;
+# endif
+            if (static_cast<std::size_t>(epptr() - pptr()) < n) {
+                grow(n);
+            }
+            char *at = data() + offset;
+            std::char_traits<char>::move(at + n, at, size() - offset);
+            std::char_traits<char>::copy(at, s, n);
+            advance(n);
+            return true;
+        }
+
+# if DEBUG_LINE_CHUNKS
+        // outputs the line so far, returns whether the buffer is empty again
+        bool chunk_out() {
+            if (!streaming) {
+                return false;
+            }
+            if (!streamed) {
+                debug_stream_begin();
+                streamed = true;
+            }
+            debug_output(data(), size());
+            flushed += size();
+            reset();
+            return true;
+        }
+
+# endif
+# if DEBUG_STREAM_THRESHOLD
+        // outputs the line so far instead of growing past the threshold
+        bool stream_out(std::size_t n) {
+            if (size() + n <= DEBUG_STREAM_THRESHOLD) {
+                return false;
+            }
+            return chunk_out();
+        }
+
+# endif
+        int_type overflow(int_type ch) override {
+            if (traits_type::eq_int_type(ch, traits_type::eof())) {
+                return traits_type::not_eof(ch);
+            }
+# if DEBUG_STREAM_THRESHOLD
+            if (!stream_out(1)) {
+                grow(1);
+            }
+# else
+            grow(1);
+# endif
+            *pptr() = traits_type::to_char_type(ch);
+            pbump(1);
+            return ch;
+        }
+
+        std::streamsize xsputn(char const *s, std::streamsize n) override {
+            std::size_t count = static_cast<std::size_t>(n);
+            if (static_cast<std::size_t>(epptr() - pptr()) < count) {
+# if DEBUG_STREAM_THRESHOLD
+                if (!stream_out(count)) {
+                    grow(count);
+                } else if (count > storage.size()) {
+                    DEBUG_UNLIKELY {
+                        debug_output(s, count);
+                        return n;
+                    }
+                }
+# else
+                grow(count);
+# endif
+            }
+            std::char_traits<char>::copy(pptr(), s, count);
+            advance(count);
+            return n;
+        }
+    };
+
+    // std::ostream is expensive to construct (locale setup), and a fresh
+    // std::ostringstream reallocates its buffer for every line, so each
+    // thread keeps a free list of line streams and reuses them
+    struct debug_line_stream : std::ostream {
+        debug_line_buffer buf;
+        debug_ref_table refs;
+        std::size_t max_bytes = DEBUG_MAX_BYTES;
+        bool truncated = false;
+        debug_line_stream *next = nullptr;
+
+        debug_line_stream() : std::ostream(nullptr) {
+            rdbuf(&buf);
+            pword(debug_line_stream_index()) = this;
+        }
+
+        char const *data() const noexcept {
+            return buf.data();
+        }
+
+        std::size_t size() const noexcept {
+            return buf.size();
+        }
+
+        std::string str() const {
+            return std::string(buf.data(), buf.size());
+        }
+
+        void append(char const *s, std::size_t n) {
+            buf.sputn(s, static_cast<std::streamsize>(n));
+        }
+
+        void reset() {
+            if (buf.storage.size() > DEBUG_LINE_BUFFER_MAX_RETAINED) {
+                DEBUG_UNLIKELY {
+                    std::string(DEBUG_LINE_BUFFER_SIZE, '\0')
+                        .swap(buf.storage);
+                }
+            }
+            rewind();
+        }
+
+        void rewind() {
+            buf.reset();
+# if DEBUG_LINE_CHUNKS
+            buf.streaming = false;
+            buf.streamed = false;
+            buf.flushed = 0;
+# endif
+            clear();
+            flags(std::ios_base::dec | std::ios_base::skipws);
+            fill(' ');
+            width(0);
+            precision(6);
+            iword(debug_range_limit_index()) = 0;
+            refs.clear();
+            max_bytes = DEBUG_MAX_BYTES;
+            truncated = false;
+        }
+    };
+
+    static debug_line_stream *debug_dead_line_stream() noexcept {
+        return reinterpret_cast<debug_line_stream *>(&debug_line_stream_pool());
+    }
+
+    // trivially destructible, so it is still usable in thread_local dtors
+    static debug_line_stream *&debug_line_stream_pool() noexcept {
+        static thread_local debug_line_stream *head = nullptr;
+        return head;
+    }
+
+    struct debug_line_stream_pool_holder {
+        ~debug_line_stream_pool_holder() {
+            debug_line_stream *&head = debug_line_stream_pool();
+            while (head) {
+                debug_line_stream *next = head->next;
+                delete head;
+                head = next;
+            }
+            head = debug_dead_line_stream();
+        }
+    };
+
+    static debug_line_stream &debug_line_stream_acquire() {
+        debug_line_stream *&head = debug_line_stream_pool();
+        if (head && head != debug_dead_line_stream()) {
+            DEBUG_LIKELY {
+                debug_line_stream *s = head;
+                head = s->next;
+                return *s;
+            }
+        }
+        if (!head) {
+            static thread_local debug_line_stream_pool_holder holder;
+            (void)holder;
+        }
+        return *new debug_line_stream();
+    }
+
+    static void debug_line_stream_release(debug_line_stream &s) noexcept {
+        debug_line_stream *&head = debug_line_stream_pool();
+        if (head == debug_dead_line_stream()) {
+            DEBUG_UNLIKELY {
+                delete &s;
+                return;
+            }
+        }
+        s.reset();
+        s.next = head;
+        head = &s;
+    }
+
+    struct debug_line_stream_lease {
+        debug_line_stream &stream;
+
+        debug_line_stream_lease() : stream(debug_line_stream_acquire()) {}
+
+        debug_line_stream_lease(debug_line_stream_lease &&) = delete;
+
+        ~debug_line_stream_lease() {
+            debug_line_stream_release(stream);
+        }
+    };
+
+# if DEBUG_DEFERRED
+    // a deferred line is a binary record in the line buffer: a '\0' marker,
+    // the source location, the timestamp (and thread id), then one tag and
+    // raw payload per argument, which is only formatted by the consumer
+    enum debug_deferred_tag : char {
+        debug_deferred_verbatim = 1,
+        debug_deferred_string,
+        debug_deferred_bool,
+        debug_deferred_char,
+        debug_deferred_signed,
+        debug_deferred_unsigned,
+        debug_deferred_float,
+        debug_deferred_double,
+        debug_deferred_pointer,
+    };
+
+    template <class T>
+    struct debug_deferred_kind
+        : std::integral_constant<
+              int,
+              debug_is_char_array<T>::value ? debug_deferred_verbatim
+              : debug_cond_string<T>::value
+                  ? (std::is_convertible<T, DEBUG_STRING_VIEW>::value
+                         ? debug_deferred_string
+                         : 0)
+              : debug_cond_bool<T>::value   ? debug_deferred_bool
+              : debug_cond_char<T>::value   ? debug_deferred_char
+              : debug_cond_unicode_char<T>::value ? 0
+              : debug_cond_integral<T>::value
+                  ? (std::is_signed<T>::value ? debug_deferred_signed
+                                              : debug_deferred_unsigned)
+              : std::is_same<T, float>::value  ? debug_deferred_float
+              : std::is_same<T, double>::value ? debug_deferred_double
+              : std::is_pointer<T>::value &&
+                      std::is_convertible<T, void const *>::value
+                  ? debug_deferred_pointer
+                  : 0> {};
+
+    template <int K>
+    using debug_deferred_kind_t = std::integral_constant<int, K>;
+
+    template <class T>
+    void debug_deferred_put(T const &value) {
+        oss.append(reinterpret_cast<char const *>(std::addressof(value)),
+                   sizeof(T));
+    }
+
+    void debug_deferred_put_bytes(char tag, char const *s, std::size_t n) {
+        debug_deferred_put(tag);
+        debug_deferred_put(static_cast<std::uint64_t>(n));
+        oss.append(s, n);
+    }
+
+    void debug_deferred_begin() {
+        deferred = true;
+        debug_deferred_put('\0');
+        debug_deferred_put(loc);
+        debug_deferred_put(debug_timestamp_now());
+        debug_deferred_put(debug_thread_now());
+    }
+
+    // types that cannot be captured by value are formatted right away
+    template <class T>
+    void debug_deferred_capture(T const &t, debug_deferred_kind_t<0>) {
+        debug_deferred_put(static_cast<char>(debug_deferred_verbatim));
+        std::size_t at = oss.size();
+        debug_deferred_put(std::uint64_t());
+        debug_format(oss, t);
+        std::uint64_t n = oss.size() - at - sizeof(std::uint64_t);
+        std::memcpy(oss.buf.data() + at, &n, sizeof(n));
+    }
+
+    template <class T>
+    void
+    debug_deferred_capture(T const &t,
+                           debug_deferred_kind_t<debug_deferred_verbatim>) {
+        debug_deferred_put_bytes(debug_deferred_verbatim, t,
+                                 std::char_traits<char>::length(t));
+    }
+
+    template <class T>
+    void debug_deferred_capture(T const &t,
+                                debug_deferred_kind_t<debug_deferred_string>) {
+        DEBUG_STRING_VIEW sv = t;
+        debug_deferred_put_bytes(debug_deferred_string, sv.data(), sv.size());
+    }
+
+    template <class T>
+    void debug_deferred_capture(T const &t,
+                                debug_deferred_kind_t<debug_deferred_bool>) {
+        debug_deferred_put(static_cast<char>(debug_deferred_bool));
+        debug_deferred_put(t);
+    }
+
+    template <class T>
+    void debug_deferred_capture(T const &t,
+                                debug_deferred_kind_t<debug_deferred_char>) {
+        debug_deferred_put(static_cast<char>(debug_deferred_char));
+        debug_deferred_put(static_cast<char>(t));
+    }
+
+    template <class T>
+    void debug_deferred_capture(T const &t,
+                                debug_deferred_kind_t<debug_deferred_signed>) {
+        debug_deferred_put(static_cast<char>(debug_deferred_signed));
+        debug_deferred_put(static_cast<std::intmax_t>(t));
+    }
+
+    template <class T>
+    void
+    debug_deferred_capture(T const &t,
+                           debug_deferred_kind_t<debug_deferred_unsigned>) {
+        debug_deferred_put(static_cast<char>(debug_deferred_unsigned));
+        debug_deferred_put(static_cast<char>(sizeof(T)));
+        debug_deferred_put(static_cast<std::uintmax_t>(t));
+    }
+
+    template <class T>
+    void debug_deferred_capture(T const &t,
+                                debug_deferred_kind_t<debug_deferred_float>) {
+        debug_deferred_put(static_cast<char>(debug_deferred_float));
+        debug_deferred_put(t);
+    }
+
+    template <class T>
+    void debug_deferred_capture(T const &t,
+                                debug_deferred_kind_t<debug_deferred_double>) {
+        debug_deferred_put(static_cast<char>(debug_deferred_double));
+        debug_deferred_put(t);
+    }
+
+    template <class T>
+    void debug_deferred_capture(T const &t,
+                                debug_deferred_kind_t<debug_deferred_pointer>) {
+        debug_deferred_put(static_cast<char>(debug_deferred_pointer));
+        debug_deferred_put(static_cast<std::uint64_t>(
+            reinterpret_cast<std::uintptr_t>(static_cast<void const *>(t))));
+    }
+
+    struct debug_deferred_reader {
+        char const *p;
+        char const *end;
+
+        template <class T>
+        T get() {
+            T value;
+            std::memcpy(static_cast<void *>(std::addressof(value)), p,
+                        sizeof(T));
+            p += sizeof(T);
+            return value;
+        }
+
+        DEBUG_STRING_VIEW get_bytes() {
+            std::size_t n = static_cast<std::size_t>(get<std::uint64_t>());
+            char const *s = p;
+            p += n;
+            return DEBUG_STRING_VIEW(s, n);
+        }
+    };
+
+    static void debug_deferred_render_args(std::ostream &oss,
+                                           debug_deferred_reader &r) {
+        bool add_space = false;
+        while (r.p < r.end) {
+            if (add_space) {
+                oss << ' ';
+            }
+            add_space = true;
+            switch (r.get<char>()) {
+            case debug_deferred_verbatim: {
+                DEBUG_STRING_VIEW sv = r.get_bytes();
+                oss.write(sv.data(), static_cast<std::streamsize>(sv.size()));
+            } break;
+            case debug_deferred_string:
+                debug_quotes(oss, r.get_bytes(), '"');
+                break;
+            case debug_deferred_bool: debug_format(oss, r.get<bool>()); break;
+            case debug_deferred_char: debug_format(oss, r.get<char>()); break;
+            case debug_deferred_signed:
+                debug_format(oss, r.get<std::intmax_t>());
+                break;
+            case debug_deferred_unsigned: {
+                char size = r.get<char>();
+                std::uintmax_t value = r.get<std::uintmax_t>();
+                if (size == 1) {
+                    debug_format(oss, static_cast<std::uint8_t>(value));
+                } else if (size == 2) {
+                    debug_format(oss, static_cast<std::uint16_t>(value));
+                } else if (size == 4) {
+                    debug_format(oss, static_cast<std::uint32_t>(value));
+                } else {
+                    debug_format(oss, static_cast<std::uint64_t>(value));
+                }
+            } break;
+            case debug_deferred_float:
+                debug_format(oss, r.get<float>());
+                break;
+            case debug_deferred_double:
+                debug_format(oss, r.get<double>());
+                break;
+            case debug_deferred_pointer:
+                debug_format(oss, reinterpret_cast<void const *>(
+                                      static_cast<std::uintptr_t>(
+                                          r.get<std::uint64_t>())));
+                break;
+            default: r.p = r.end; break;
+            }
+        }
+    }
+
+    static void debug_deferred_render(std::ostream &oss, char const *data,
+                                      std::size_t size) {
+        debug_deferred_reader r{data + 1, data + size};
+        auto loc = r.get<DEBUG_SOURCE_LOCATION>();
+        auto timestamp = r.get<std::int64_t>();
+        auto thread = r.get<decltype(debug_thread_now())>();
+        debug_format_marks(oss, loc.file_name(),
+                           static_cast<std::uint32_t>(loc.line()), timestamp,
+                           thread);
+        debug_deferred_render_args(oss, r);
+    }
+
+    // formatting is needed right now (assertion failure, string conversion)
+    void debug_deferred_undefer() {
+        if (deferred) {
+            DEBUG_UNLIKELY {
+                debug_line_stream_lease text;
+                debug_deferred_render(text.stream, oss.data(), oss.size());
+                oss.rewind();
+                oss.append(text.stream.data(), text.stream.size());
+                deferred = false;
+            }
+        }
+    }
+
+#  ifdef DEBUG_DEFERRED_FILE
+    // file layout: "DEBUGHPP" magic, then records tagged by one byte:
+    //   'S' site:  u32 id, u32 line, u64 len, file, u64 len, function
+    //   'L' line:  u32 site id, i64 timestamp, u64 thread, u64 len, arguments
+    //   'T' text:  u64 len, already formatted line
+    struct debug_deferred_file_writer {
+        std::FILE *file = nullptr;
+        std::map<std::tuple<char const *, char const *, std::uint32_t>,
+                 std::uint32_t>
+            sites;
+
+        debug_deferred_file_writer() {
+            file = std::fopen(DEBUG_DEFERRED_FILE, "wb");
+            if (file) {
+                char header[10] = {'D', 'E', 'B', 'U', 'G', 'H', 'P', 'P',
+                                   DEBUG_SHOW_TIMESTAMP, DEBUG_SHOW_THREAD_ID};
+                std::fwrite(header, 1, sizeof(header), file);
+            }
+        }
+
+        template <class T>
+        static void put(debug_line_stream &out, T const &value) {
+            out.append(reinterpret_cast<char const *>(std::addressof(value)),
+                       sizeof(T));
+        }
+
+        static void put_bytes(debug_line_stream &out, char const *s) {
+            std::uint64_t n = std::char_traits<char>::length(s);
+            put(out, n);
+            out.append(s, static_cast<std::size_t>(n));
+        }
+
+        void write(debug_line_stream &out, std::string const &slot) {
+            if (slot.empty() || slot[0] != '\0') {
+                put(out, 'T');
+                put(out, static_cast<std::uint64_t>(slot.size()));
+                out.append(slot.data(), slot.size());
+                return;
+            }
+            debug_deferred_reader r{slot.data() + 1, slot.data() + slot.size()};
+            auto loc = r.get<DEBUG_SOURCE_LOCATION>();
+            auto timestamp = r.get<std::int64_t>();
+            auto thread = r.get<decltype(debug_thread_now())>();
+            auto key = std::make_tuple(loc.file_name(), loc.function_name(),
+                                       static_cast<std::uint32_t>(loc.line()));
+            auto it = sites.find(key);
+            if (it == sites.end()) {
+                auto id = static_cast<std::uint32_t>(sites.size());
+                it = sites.emplace(key, id).first;
+                put(out, 'S');
+                put(out, id);
+                put(out, std::get<2>(key));
+                put_bytes(out, loc.file_name());
+                put_bytes(out, loc.function_name());
+            }
+            put(out, 'L');
+            put(out, it->second);
+            put(out, timestamp);
+            put(out, static_cast<std::uint64_t>(
+                         std::hash<decltype(thread)>()(thread)));
+            put(out, static_cast<std::uint64_t>(r.end - r.p));
+            out.append(r.p, static_cast<std::size_t>(r.end - r.p));
+        }
+
+        void output(debug_line_stream &out) {
+            if (file) {
+                std::fwrite(out.data(), 1, out.size(), file);
+                std::fflush(file);
+            }
+        }
+    };
+#  endif
+
+public:
+    // decodes a DEBUG_DEFERRED_FILE, must be built with the same DEBUG_xxx
+    // configuration macros as the program that wrote it
+    static bool deferred_decode(std::istream &in, std::ostream &out) {
+        char header[10];
+        if (!in.read(header, sizeof(header)) ||
+            std::string(header, 8) != "DEBUGHPP" ||
+            header[8] != DEBUG_SHOW_TIMESTAMP ||
+            header[9] != DEBUG_SHOW_THREAD_ID) {
+            return false;
+        }
+        struct site {
+            std::string file;
+            std::uint32_t line;
+        };
+
+        std::vector<site> sites;
+        std::string buf;
+        auto read_bytes = [&](std::string &s) -> bool {
+            std::uint64_t n;
+            if (!in.read(reinterpret_cast<char *>(&n), sizeof(n))) {
+                return false;
+            }
+            s.resize(static_cast<std::size_t>(n));
+            return n == 0 || in.read(&s[0], static_cast<std::streamsize>(n));
+        };
+        char type;
+        while (in.get(type)) {
+            if (type == 'T') {
+                if (!read_bytes(buf)) {
+                    return false;
+                }
+                out << buf;
+            } else if (type == 'S') {
+                std::uint32_t id, line;
+                std::string function;
+                site s;
+                if (!in.read(reinterpret_cast<char *>(&id), sizeof(id)) ||
+                    !in.read(reinterpret_cast<char *>(&line), sizeof(line)) ||
+                    !read_bytes(s.file) || !read_bytes(function)) {
+                    return false;
+                }
+                s.line = line;
+                if (sites.size() <= id) {
+                    sites.resize(id + 1);
+                }
+                sites[id] = std::move(s);
+            } else if (type == 'L') {
+                std::uint32_t id;
+                std::int64_t timestamp;
+                std::uint64_t thread;
+                if (!in.read(reinterpret_cast<char *>(&id), sizeof(id)) ||
+                    !in.read(reinterpret_cast<char *>(&timestamp),
+                             sizeof(timestamp)) ||
+                    !in.read(reinterpret_cast<char *>(&thread),
+                             sizeof(thread)) ||
+                    !read_bytes(buf) || id >= sites.size()) {
+                    return false;
+                }
+                debug_format_marks(out, sites[id].file.c_str(), sites[id].line,
+                                   timestamp, thread);
+                debug_deferred_reader r{buf.data(), buf.data() + buf.size()};
+                debug_deferred_render_args(out, r);
+                out << '\n';
+            } else {
+                return false;
+            }
+        }
+        return true;
+    }
+
+private:
+# endif
+
+# if DEBUG_ASYNC
+    struct debug_async_ring {
+        std::string slots[DEBUG_ASYNC_RING_SIZE];
+        std::atomic<std::size_t> head{0};
+        char padding[64];
+        std::atomic<std::size_t> tail{0};
+        std::atomic<bool> alive{true};
+    };
+
+    struct debug_async_backend {
+        // guards new_rings and the sleep of the worker, never held while
+        // output is written
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::vector<std::shared_ptr<debug_async_ring>> new_rings;
+        // makes whoever drains the only consumer of all rings, and keeps the
+        // batches in order, guards rings and batch
+        std::mutex drain_mutex;
+        std::vector<std::shared_ptr<debug_async_ring>> rings;
+        debug_line_stream batch;
+#  ifdef DEBUG_DEFERRED_FILE
+        debug_deferred_file_writer writer;
+#  endif
+        std::thread worker;
+        std::atomic<bool> stopped{false};
+        std::atomic<bool> finished{false};
+        std::atomic<std::size_t> dropped{0};
+
+        // must be called with drain_mutex locked
+        void consume(std::string const &slot) {
+#  if DEBUG_DEFERRED
+#   ifdef DEBUG_DEFERRED_FILE
+            writer.write(batch, slot);
+            return;
+#   else
+            if (!slot.empty() && slot[0] == '\0') {
+                debug_deferred_render(batch, slot.data(), slot.size());
+                batch << '\n';
+                return;
+            }
+#   endif
+#  endif
+            batch.append(slot.data(), slot.size());
+        }
+
+        bool drain() {
+            std::lock_guard<std::mutex> drain_lock(drain_mutex);
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                for (auto &ring: new_rings) {
+                    rings.push_back(std::move(ring));
+                }
+                new_rings.clear();
+            }
+            batch.rewind();
+            for (auto it = rings.begin(); it != rings.end();) {
+                debug_async_ring &ring = **it;
+                bool alive = ring.alive.load(std::memory_order_acquire);
+                std::size_t h = ring.head.load(std::memory_order_relaxed);
+                // seq_cst, see debug_async_shutdown
+                std::size_t t = ring.tail.load();
+                for (; h != t; ++h) {
+                    std::string &slot = ring.slots[h % DEBUG_ASYNC_RING_SIZE];
+                    consume(slot);
+                    slot.clear();
+                }
+                ring.head.store(h, std::memory_order_release);
+                if (!alive) {
+                    it = rings.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+            if (batch.size() == 0) {
+                return false;
+            }
+#  ifdef DEBUG_DEFERRED_FILE
+            writer.output(batch);
+#  else
+            debug_output(batch.data(), batch.size());
+            debug_sink_flush();
+#  endif
+            return true;
+        }
+
+        void run() {
+            while (!stopped.load(std::memory_order_acquire)) {
+                drain();
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait_for(lock,
+                            std::chrono::milliseconds(
+                                DEBUG_ASYNC_FLUSH_INTERVAL),
+                            [this] {
+                                return stopped.load(std::memory_order_relaxed);
+                            });
+            }
+            drain();
+        }
+    };
+
+    static void debug_async_shutdown() {
+        debug_async_backend &b = debug_async_instance();
+        {
+            std::lock_guard<std::mutex> lock(b.mutex);
+            b.stopped.store(true, std::memory_order_release);
+        }
+        b.cv.notify_one();
+        if (b.worker.joinable()) {
+            b.worker.join();
+        }
+        // pairs with the check after a push, a line is either seen by this
+        // drain or drained by the thread that pushed it
+        b.finished.store(true);
+        b.drain();
+        if (std::size_t n = b.dropped.load()) {
+            std::string msg = "debug: " + std::to_string(n) +
+                              " lines dropped due to full ring buffer\n";
+            debug_output(msg.data(), msg.size());
+        }
+        debug_sink_flush();
+    }
+
+    static debug_async_backend &debug_async_instance() {
+        // intentionally leaked, so that debug() in static destructors is safe
+        static debug_async_backend *instance = [] {
+            auto *b = new debug_async_backend();
+            b->worker = std::thread([b] {
+                b->run();
+            });
+            std::atexit(debug_async_shutdown);
+            return b;
+        }();
+        return *instance;
+    }
+
+    struct debug_async_ring_holder {
+        std::shared_ptr<debug_async_ring> ring;
+
+        ~debug_async_ring_holder() {
+            if (ring) {
+                ring->alive.store(false, std::memory_order_release);
+            }
+            debug_async_tls_ring() = debug_async_dead_ring();
+        }
+    };
+
+    static debug_async_ring *debug_async_dead_ring() noexcept {
+        return reinterpret_cast<debug_async_ring *>(
+            &debug_async_tls_ring());
+    }
+
+    static debug_async_ring *&debug_async_tls_ring() noexcept {
+        static thread_local debug_async_ring *ring = nullptr;
+        return ring;
+    }
+
+    static debug_async_ring *debug_async_this_ring(debug_async_backend &b) {
+        debug_async_ring *&ring = debug_async_tls_ring();
+        if (!ring) {
+            DEBUG_UNLIKELY {
+                static thread_local debug_async_ring_holder holder;
+                holder.ring = std::make_shared<debug_async_ring>();
+                {
+                    std::lock_guard<std::mutex> lock(b.mutex);
+                    b.new_rings.push_back(holder.ring);
+                }
+                ring = holder.ring.get();
+            }
+        }
+        return ring;
+    }
+
+    static void debug_async_push(char const *data, std::size_t size) {
+        debug_async_backend &b = debug_async_instance();
+        debug_async_ring *ring = debug_async_this_ring(b);
+        if (ring == debug_async_dead_ring() ||
+            b.finished.load(std::memory_order_acquire)) {
+            DEBUG_UNLIKELY {
+                debug_output(data, size);
+                return;
+            }
+        }
+        std::size_t t = ring->tail.load(std::memory_order_relaxed);
+        while (t - ring->head.load(std::memory_order_acquire) >=
+               DEBUG_ASYNC_RING_SIZE) {
+            DEBUG_UNLIKELY {
+#  if DEBUG_ASYNC_FULL_POLICY == 0
+                b.dropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+#  else
+                b.cv.notify_one();
+                std::this_thread::yield();
+                if (b.finished.load(std::memory_order_acquire)) {
+                    debug_output(data, size);
+                    return;
+                }
+#  endif
+            }
+        }
+        // assign() reuses the capacity left in the slot by previous lines
+        ring->slots[t % DEBUG_ASYNC_RING_SIZE].assign(data, size);
+        ring->tail.store(t + 1);
+        if (b.finished.load()) {
+            DEBUG_UNLIKELY {
+                b.drain();
+            }
+        }
+    }
+# endif
+
+# if DEBUG_FLIGHT_RECORDER
+    // one line of fixed size, a seqlock: seq is odd while its thread writes
+    // it, a reader copies it and keeps the copy only if seq was even and
+    // did not change, every word is atomic (release stores, acquire loads)
+    // so that a racing copy is detected instead of undefined
+    struct debug_flight_slot {
+        std::atomic<std::uint64_t> seq{0};
+        std::atomic<std::int64_t> stamp{0};
+        std::atomic<std::uint64_t> size{0};
+        std::atomic<std::uint64_t> words[DEBUG_FLIGHT_RECORDER_LINE_SIZE / 8];
+
+        debug_flight_slot() noexcept {
+            for (auto &word: words) {
+                word.store(0, std::memory_order_relaxed);
+            }
+        }
+
+        void write(char const *data, std::size_t n,
+                   std::int64_t when) noexcept {
+            std::uint64_t s = seq.load(std::memory_order_relaxed);
+            seq.store(s + 1, std::memory_order_relaxed);
+            stamp.store(when, std::memory_order_release);
+            size.store(n, std::memory_order_release);
+            for (std::size_t i = 0; i * 8 < n; ++i) {
+                std::uint64_t word = 0;
+                std::size_t k = n - i * 8 < 8 ? n - i * 8 : 8;
+                std::memcpy(&word, data + i * 8, k);
+                words[i].store(word, std::memory_order_release);
+            }
+            seq.store(s + 2, std::memory_order_release);
+        }
+
+        // false if the slot was being written, or has been since expected
+        bool read(std::uint64_t expected, char *out, std::size_t &n,
+                  std::int64_t &when) const noexcept {
+            if (seq.load(std::memory_order_acquire) != expected) {
+                return false;
+            }
+            when = stamp.load(std::memory_order_acquire);
+            n = static_cast<std::size_t>(size.load(std::memory_order_acquire));
+            if (n > DEBUG_FLIGHT_RECORDER_LINE_SIZE) {
+                return false;
+            }
+            for (std::size_t i = 0; i * 8 < n; ++i) {
+                std::uint64_t word = words[i].load(std::memory_order_acquire);
+                std::size_t k = n - i * 8 < 8 ? n - i * 8 : 8;
+                std::memcpy(out + i * 8, &word, k);
+            }
+            return seq.load(std::memory_order_acquire) == expected;
+        }
+    };
+
+    static_assert(DEBUG_FLIGHT_RECORDER_LINE_SIZE % 8 == 0 &&
+                      DEBUG_FLIGHT_RECORDER_LINE_SIZE >= 64,
+                  "DEBUG_FLIGHT_RECORDER_LINE_SIZE must be a multiple of 8, "
+                  "at least 64");
+
+    // written only by its thread, read by whichever thread dumps it, and
+    // taken over by a new thread once its thread has exited
+    struct debug_flight_ring {
+        debug_flight_slot slots[DEBUG_FLIGHT_RECORDER];
+        std::atomic<std::uint64_t> count{0};
+        std::uint64_t dumped = 0;
+        std::atomic<bool> owned{true};
+        debug_flight_ring *next = nullptr;
+
+        // the seq of line n once written, each write of a slot adds 2
+        static std::uint64_t seq_of(std::uint64_t n) noexcept {
+            return (n / DEBUG_FLIGHT_RECORDER + 1) * 2;
+        }
+    };
+
+    // rings are never freed, so the list can be walked lock-free (in signal
+    // handlers)
+    static std::atomic<debug_flight_ring *> &debug_flight_rings() noexcept {
+        static std::atomic<debug_flight_ring *> head{nullptr};
+        return head;
+    }
+
+    struct debug_flight_ring_holder {
+        debug_flight_ring *ring = nullptr;
+
+        ~debug_flight_ring_holder() {
+            if (ring) {
+                ring->owned.store(false, std::memory_order_release);
+            }
+            debug_flight_tls_ring() = debug_flight_dead_ring();
+        }
+    };
+
+    static debug_flight_ring *debug_flight_dead_ring() noexcept {
+        return reinterpret_cast<debug_flight_ring *>(&debug_flight_tls_ring());
+    }
+
+    static debug_flight_ring *&debug_flight_tls_ring() noexcept {
+        static thread_local debug_flight_ring *ring = nullptr;
+        return ring;
+    }
+
+    static debug_flight_ring *debug_flight_this_ring() {
+        debug_flight_ring *&ring = debug_flight_tls_ring();
+        if (!ring) {
+            DEBUG_UNLIKELY {
+                static thread_local debug_flight_ring_holder holder;
+                std::atomic<debug_flight_ring *> &head = debug_flight_rings();
+                debug_flight_ring *r = head.load(std::memory_order_acquire);
+                for (; r; r = r->next) {
+                    bool expected = false;
+                    if (r->owned.compare_exchange_strong(expected, true)) {
+                        holder.ring = r;
+                        break;
+                    }
+                }
+                if (!holder.ring) {
+                    holder.ring = new debug_flight_ring();
+                    holder.ring->next = head.load(std::memory_order_relaxed);
+                    while (!head.compare_exchange_weak(
+                        holder.ring->next, holder.ring,
+                        std::memory_order_release, std::memory_order_relaxed))
+                        ;
+                    static bool installed = debug_flight_install();
+                    (void)installed;
+                }
+                ring = holder.ring;
+            }
+        }
+        return ring;
+    }
+
+    // false if this thread has already exited (thread_local destructors)
+    static bool debug_flight_record(char const *data, std::size_t size) {
+        debug_flight_ring *ring = debug_flight_this_ring();
+        if (ring == debug_flight_dead_ring()) {
+            DEBUG_UNLIKELY {
+                return false;
+            }
+        }
+#  if DEBUG_DEFERRED
+        // a record that does not fit is rendered now, it cannot be cut
+        if (size > DEBUG_FLIGHT_RECORDER_LINE_SIZE && data[0] == '\0') {
+            DEBUG_UNLIKELY {
+                debug_line_stream_lease text;
+                debug_deferred_render(text.stream, data, size);
+                text.stream << '\n';
+                return debug_flight_record(text.stream.data(),
+                                           text.stream.size());
+            }
+        }
+#  endif
+        std::uint64_t n = ring->count.load(std::memory_order_relaxed);
+        std::int64_t when =
+            std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch())
+                .count();
+        char cut[DEBUG_FLIGHT_RECORDER_LINE_SIZE];
+        if (size > sizeof(cut)) {
+            DEBUG_UNLIKELY {
+                static char const tail[] = DEBUG_TRUNCATED_STRING "\n";
+                std::size_t keep = sizeof(cut) - (sizeof(tail) - 1);
+                std::memcpy(cut, data, keep);
+                std::memcpy(cut + keep, tail, sizeof(tail) - 1);
+                data = cut;
+                size = sizeof(cut);
+            }
+        }
+        ring->slots[n % DEBUG_FLIGHT_RECORDER].write(data, size, when);
+        ring->count.store(n + 1, std::memory_order_release);
+        return true;
+    }
+
+    // writes the decimal digits of v to end back, returns where they start
+    static char *debug_flight_digits(char *end, std::uint64_t v) noexcept {
+        do {
+            *--end = static_cast<char>('0' + v % 10);
+            v /= 10;
+        } while (v);
+        return end;
+    }
+
+    // in a signal handler only write(2) is safe: no std::cerr, no sink (which
+    // locks), no allocation
+    static void debug_flight_write(char const *data, std::size_t size,
+                                   bool in_signal) {
+        if (!in_signal) {
+            debug_output(data, size);
+            return;
+        }
+        while (size != 0) {
+#  if defined(_WIN32)
+            int w = ::_write(2, data, static_cast<unsigned>(size));
+#  else
+            ::ssize_t w = ::write(STDERR_FILENO, data, size);
+#  endif
+            if (w < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return;
+            }
+            data += w;
+            size -= static_cast<std::size_t>(w);
+        }
+    }
+
+    static void debug_flight_dump(bool in_signal) {
+        // a crash while dumping must not dump again
+        static std::atomic<bool> dumping{false};
+        if (dumping.exchange(true, std::memory_order_acquire)) {
+            return;
+        }
+        std::atomic<debug_flight_ring *> &head = debug_flight_rings();
+        std::uint64_t total = 0;
+        for (debug_flight_ring *r = head.load(std::memory_order_acquire); r;
+             r = r->next) {
+            std::uint64_t n = r->count.load(std::memory_order_acquire);
+            if (n - r->dumped > DEBUG_FLIGHT_RECORDER) {
+                r->dumped = n - DEBUG_FLIGHT_RECORDER;
+            }
+            total += n - r->dumped;
+        }
+        if (total != 0) {
+            // no allocation, this may run in a signal handler
+            char msg[64] = "debug: flight recorder, last ";
+            std::size_t n = std::char_traits<char>::length(msg);
+            char digits[20];
+            char *d = debug_flight_digits(digits + 20, total);
+            std::char_traits<char>::copy(msg + n, d, digits + 20 - d);
+            n += digits + 20 - d;
+            std::char_traits<char>::copy(msg + n, " lines:\n", 8);
+            debug_flight_write(msg, n + 8, in_signal);
+        }
+        // each ring is in time order already, so repeatedly output the
+        // oldest of their first lines, without allocating, a line overwritten
+        // by its thread while this runs is skipped
+        char line[DEBUG_FLIGHT_RECORDER_LINE_SIZE];
+        for (; total != 0; --total) {
+            debug_flight_ring *oldest = nullptr;
+            std::int64_t oldest_stamp = 0;
+            for (debug_flight_ring *r = head.load(std::memory_order_acquire);
+                 r; r = r->next) {
+                if (r->dumped == r->count.load(std::memory_order_acquire)) {
+                    continue;
+                }
+                debug_flight_slot const &s =
+                    r->slots[r->dumped % DEBUG_FLIGHT_RECORDER];
+                std::int64_t stamp = s.stamp.load(std::memory_order_acquire);
+                if (!oldest || stamp < oldest_stamp) {
+                    oldest = r;
+                    oldest_stamp = stamp;
+                }
+            }
+            if (!oldest) {
+                break;
+            }
+            std::uint64_t i = oldest->dumped++;
+            std::size_t size;
+            std::int64_t stamp;
+            if (!oldest->slots[i % DEBUG_FLIGHT_RECORDER].read(
+                    debug_flight_ring::seq_of(i), line, size, stamp)) {
+                continue;
+            }
+#  if DEBUG_DEFERRED
+            if (size != 0 && line[0] == '\0') {
+                if (in_signal) {
+                    debug_flight_write_deferred(line, size);
+                    continue;
+                }
+                debug_line_stream_lease text;
+                debug_deferred_render(text.stream, line, size);
+                text.stream << '\n';
+                debug_output(text.stream.data(), text.stream.size());
+                continue;
+            }
+#  endif
+            debug_flight_write(line, size, in_signal);
+        }
+        if (!in_signal) {
+            debug_sink_flush();
+        }
+        dumping.store(false, std::memory_order_release);
+    }
+
+#  if DEBUG_DEFERRED
+    // rendering a record allocates, so a signal handler only gives its
+    // location
+    static void debug_flight_write_deferred(char const *data,
+                                            std::size_t size) {
+        debug_deferred_reader r{data + 1, data + size};
+        auto loc = r.get<DEBUG_SOURCE_LOCATION>();
+        char const *file = loc.file_name();
+        debug_flight_write(file, std::char_traits<char>::length(file), true);
+        char digits[24];
+        char *d = debug_flight_digits(digits + sizeof(digits), loc.line());
+        *--d = ':';
+        debug_flight_write(d, digits + sizeof(digits) - d, true);
+        static char const rest[] = ": (deferred, not rendered in a signal "
+                                   "handler)\n";
+        debug_flight_write(rest, sizeof(rest) - 1, true);
+    }
+#  endif
+
+    static void debug_flight_signal(int sig) {
+        int saved_errno = errno;
+        debug_flight_dump(true);
+        errno = saved_errno;
+        // let the previous handler (or the default action) take it from here
+        std::signal(sig, debug_flight_previous(sig));
+        std::raise(sig);
+    }
+
+    using debug_signal_handler = void (*)(int);
+
+    static debug_signal_handler &debug_flight_previous(int sig) {
+        static debug_signal_handler previous[5] = {};
+        int const *signals = debug_flight_signals();
+        int i = 0;
+        while (signals[i] != sig) {
+            ++i;
+        }
+        return previous[i];
+    }
+
+    static int const *debug_flight_signals() noexcept {
+        static int const signals[] = {SIGSEGV, SIGABRT, SIGFPE, SIGILL,
+#  ifdef SIGBUS
+                                      SIGBUS,
+#  endif
+                                      0};
+        return signals;
+    }
+
+    static bool debug_flight_install() {
+        for (int const *sig = debug_flight_signals(); *sig; ++sig) {
+            debug_signal_handler previous =
+                std::signal(*sig, debug_flight_signal);
+            debug_flight_previous(*sig) =
+                previous == SIG_ERR ? SIG_DFL : previous;
+        }
+        return true;
+    }
+
+public:
+    // output the lines kept by DEBUG_FLIGHT_RECORDER right now, each line is
+    // output only once
+    static void dump_flight_recorder() {
+        flush();
+        debug_flight_dump(false);
+    }
+
+private:
+# else
+
+public:
+    // keeps nothing without DEBUG_FLIGHT_RECORDER
+    static void dump_flight_recorder() {}
+
+private:
+# endif
+
+    static void debug_emit(char const *data, std::size_t size) {
+# if DEBUG_FLIGHT_RECORDER
+        if (debug_flight_record(data, size)) {
+            return;
+        }
+# endif
+# if DEBUG_ASYNC
+        debug_async_push(data, size);
+# else
+        debug_output(data, size);
+# endif
+    }
+
+public:
+    static void flush() {
+# if DEBUG_ASYNC
+        debug_async_instance().drain();
+# endif
+        debug_sink_flush();
+    }
+
+# if DEBUG_SINKS
+    // receives the finished lines once installed with set_sink(), write()
+    // is called from any thread with one or more whole lines
+    struct sink {
+        virtual ~sink() = default;
+        virtual void write(char const *data, std::size_t size) = 0;
+
+        virtual void flush() {}
+    };
+
+    // one write(2) per line, which the kernel does not interleave with
+    // other writers when the fd is opened with O_APPEND, so no lock is taken
+    struct fd_sink : sink {
+        explicit fd_sink(int fd) noexcept : fd(fd), owned(false) {}
+
+        explicit fd_sink(std::string const &path)
+            : fd(debug_sink_open(path)), owned(true) {}
+
+        ~fd_sink() override {
+            if (owned) {
+                ::close(fd);
+            }
+        }
+
+        fd_sink(fd_sink const &) = delete;
+        fd_sink &operator=(fd_sink const &) = delete;
+
+        void write(char const *data, std::size_t size) override {
+            ::iovec iov;
+            iov.iov_base = const_cast<char *>(data);
+            iov.iov_len = size;
+            debug_sink_writev(fd, &iov, 1);
+        }
+
+    private:
+        int fd;
+        bool owned;
+    };
+
+    // coalesces lines in memory, and hands them to the kernel in a single
+    // writev(2) once the buffer is full, on debug::flush(), on panic and at
+    // exit (with DEBUG_ASYNC, also after every batch of the background thread)
+    struct file_sink : sink {
+        explicit file_sink(std::string path, std::size_t buffer_size = 65536)
+            : path(std::move(path)),
+              fd(debug_sink_open(this->path)),
+              capacity(buffer_size) {
+            buffer.reserve(capacity);
+            struct ::stat st;
+            if (::fstat(fd, &st) == 0) {
+                written = static_cast<std::size_t>(st.st_size);
+            }
+        }
+
+        ~file_sink() override {
+            flush();
+            ::close(fd);
+        }
+
+        file_sink(file_sink const &) = delete;
+        file_sink &operator=(file_sink const &) = delete;
+
+        void write(char const *data, std::size_t size) override {
+            std::lock_guard<std::mutex> lock(mutex);
+            append(data, size);
+        }
+
+        void flush() override {
+            std::lock_guard<std::mutex> lock(mutex);
+            drain(nullptr, 0);
+        }
+
+    protected:
+        std::string path;
+        int fd;
+        std::size_t capacity;
+        std::size_t written = 0;
+        std::string buffer;
+        std::mutex mutex;
+
+        // must be called with mutex locked
+        virtual void append(char const *data, std::size_t size) {
+            if (buffer.size() + size <= capacity) {
+                buffer.append(data, size);
+            } else {
+                drain(data, size);
+            }
+        }
+
+        // writes out the buffer followed by data, without copying data into
+        // the buffer first, must be called with mutex locked
+        void drain(char const *data, std::size_t size) {
+            ::iovec iov[2];
+            iov[0].iov_base = &buffer[0];
+            iov[0].iov_len = buffer.size();
+            iov[1].iov_base = const_cast<char *>(data);
+            iov[1].iov_len = size;
+            debug_sink_writev(fd, iov, 2);
+            written += buffer.size() + size;
+            buffer.clear();
+        }
+    };
+
+    // a file_sink that renames the file to path.1 (path.1 to path.2, and so
+    // on, up to max_files old files) and starts a new one whenever it would
+    // grow beyond max_size, the space of each file is reserved up front, so
+    // appending lines never has to allocate blocks (Linux only)
+    struct rotating_file_sink : file_sink {
+        rotating_file_sink(std::string path, std::size_t max_size,
+                           std::size_t max_files = 3,
+                           std::size_t buffer_size = 65536)
+            : file_sink(std::move(path), buffer_size),
+              max_size(max_size),
+              max_files(max_files) {
+            preallocate();
+        }
+
+    private:
+        std::size_t max_size;
+        std::size_t max_files;
+
+        // data may hold many lines (a DEBUG_ASYNC batch), so split it at the
+        // last line that still fits into the current file
+        void append(char const *data, std::size_t size) override {
+            while (size != 0) {
+                std::size_t pending = written + buffer.size();
+                std::size_t room = pending < max_size ? max_size - pending : 0;
+                if (size <= room) {
+                    file_sink::append(data, size);
+                    return;
+                }
+                std::size_t n = room;
+                while (n != 0 && data[n - 1] != '\n') {
+                    --n;
+                }
+                if (n == 0 && pending == 0) {
+                    // a single line longer than max_size gets a file of its
+                    // own
+                    while (n != size && data[n] != '\n') {
+                        ++n;
+                    }
+                    n += n != size;
+                }
+                file_sink::append(data, n);
+                drain(nullptr, 0);
+                rotate();
+                data += n;
+                size -= n;
+            }
+        }
+
+        void rotate() {
+            ::close(fd);
+            if (max_files == 0) {
+                std::remove(path.c_str());
+            }
+            for (std::size_t i = max_files; i > 0; --i) {
+                std::string from =
+                    i == 1 ? path : path + '.' + std::to_string(i - 1);
+                std::rename(from.c_str(),
+                            (path + '.' + std::to_string(i)).c_str());
+            }
+            fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+                        0644);
+            written = 0;
+            preallocate();
+        }
+
+        void preallocate() {
+#  if defined(__linux__) && defined(FALLOC_FL_KEEP_SIZE)
+            // KEEP_SIZE leaves the file size alone, so O_APPEND still
+            // writes right after the last line
+            if (fd >= 0 && written < max_size) {
+                ::fallocate(fd, FALLOC_FL_KEEP_SIZE,
+                            static_cast<::off_t>(written),
+                            static_cast<::off_t>(max_size - written));
+            }
+#  endif
+        }
+    };
+
+    // writes every line to each of the given sinks in turn
+    struct fanout_sink : sink {
+        explicit fanout_sink(std::vector<std::shared_ptr<sink>> sinks)
+            : sinks(std::move(sinks)) {}
+
+        void write(char const *data, std::size_t size) override {
+            for (auto const &s: sinks) {
+                s->write(data, size);
+            }
+        }
+
+        void flush() override {
+            for (auto const &s: sinks) {
+                s->flush();
+            }
+        }
+
+    private:
+        std::vector<std::shared_ptr<sink>> sinks;
+    };
+
+    // copies lines into a ring of size bytes in a file mapped with
+    // MAP_SHARED, so writing a line is a plain memcpy, and the kernel still
+    // has the last size bytes of output after the process is killed or
+    // crashes, read it back in order with debug::ring_decode (see
+    // debug_ring.cpp), an existing ring file of the same size is continued
+    struct mmap_ring_sink : sink {
+        explicit mmap_ring_sink(std::string const &path,
+                                std::size_t size = 4 << 20)
+            : capacity(size) {
+            int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+            if (fd < 0) {
+                throw std::system_error(errno, std::generic_category(), path);
+            }
+            debug_ring_header header;
+            ::off_t length = static_cast<::off_t>(sizeof(header) + capacity);
+            struct ::stat st;
+            bool reuse = ::fstat(fd, &st) == 0 && st.st_size == length &&
+                         ::pread(fd, &header, sizeof(header), 0) ==
+                             static_cast<::ssize_t>(sizeof(header)) &&
+                         std::memcmp(header.magic, "DEBUGRNG", 8) == 0 &&
+                         header.capacity == capacity;
+            if (!reuse && ::ftruncate(fd, length) != 0) {
+                int e = errno;
+                ::close(fd);
+                throw std::system_error(e, std::generic_category(), path);
+            }
+            void *p = ::mmap(nullptr, sizeof(header) + capacity,
+                             PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            int e = errno;
+            ::close(fd);
+            if (p == MAP_FAILED) {
+                throw std::system_error(e, std::generic_category(), path);
+            }
+            map = static_cast<char *>(p);
+            if (!reuse) {
+                header = debug_ring_header();
+                std::memcpy(header.magic, "DEBUGRNG", 8);
+                header.capacity = capacity;
+                std::memcpy(map, &header, sizeof(header));
+            }
+            cursor = reinterpret_cast<std::atomic<std::uint64_t> *>(
+                map + offsetof(debug_ring_header, cursor));
+        }
+
+        ~mmap_ring_sink() override {
+            ::munmap(map, sizeof(debug_ring_header) + capacity);
+        }
+
+        mmap_ring_sink(mmap_ring_sink const &) = delete;
+        mmap_ring_sink &operator=(mmap_ring_sink const &) = delete;
+
+        void write(char const *data, std::size_t size) override {
+            if (size > capacity) {
+                data += size - capacity;
+                size = capacity;
+            }
+            std::uint64_t at = cursor->fetch_add(size,
+                                                 std::memory_order_relaxed);
+            std::size_t pos = static_cast<std::size_t>(at % capacity);
+            std::size_t n = capacity - pos < size ? capacity - pos : size;
+            char *ring = map + sizeof(debug_ring_header);
+            std::memcpy(ring + pos, data, n);
+            std::memcpy(ring, data + n, size - n);
+        }
+
+    private:
+        std::size_t capacity;
+        char *map = nullptr;
+        std::atomic<std::uint64_t> *cursor = nullptr;
+    };
+
+    // writes the lines kept by an mmap_ring_sink file into out, oldest
+    // first, returns false if in is not such a file
+    static bool ring_decode(std::istream &in, std::ostream &out) {
+        debug_ring_header header;
+        if (!in.read(reinterpret_cast<char *>(&header), sizeof(header)) ||
+            std::memcmp(header.magic, "DEBUGRNG", 8) != 0 ||
+            header.capacity == 0) {
+            return false;
+        }
+        std::string ring(static_cast<std::size_t>(header.capacity), '\0');
+        if (!in.read(&ring[0], static_cast<std::streamsize>(ring.size()))) {
+            return false;
+        }
+        if (header.cursor <= header.capacity) {
+            out.write(ring.data(), static_cast<std::streamsize>(header.cursor));
+            return true;
+        }
+        // the ring has wrapped, the oldest bytes start at the cursor, and
+        // the line they begin with has been partly overwritten
+        std::size_t pos = static_cast<std::size_t>(header.cursor %
+                                                   header.capacity);
+        std::string text = ring.substr(pos) + ring.substr(0, pos);
+        std::size_t first = text.find('\n');
+        if (first != std::string::npos) {
+            out << "debug: " << header.cursor / header.capacity
+                << " wraps, older lines were overwritten\n";
+            out.write(text.data() + first + 1,
+                      static_cast<std::streamsize>(text.size() - first - 1));
+        }
+        return true;
+    }
+
+    // output all lines to s from now on (nullptr goes back to DEBUG_OUTPUT),
+    // the previous sink is flushed and released once the threads that were
+    // writing to it are done
+    static void set_sink(std::shared_ptr<sink> s) {
+        static debug_sink_registry *registry = [] {
+            auto *r = new debug_sink_registry();
+            std::atexit(debug_sink_shutdown);
+            return r;
+        }();
+        std::lock_guard<std::mutex> lock(registry->mutex);
+        flush();
+        debug_sink_current().store(s.get());
+        auto &gate = debug_sink_gate();
+        unsigned epoch = gate.epoch.fetch_add(1);
+        while (gate.writers[epoch & 1].load(std::memory_order_acquire)) {
+            std::this_thread::yield();
+        }
+        std::shared_ptr<sink> previous = std::move(registry->installed);
+        registry->installed = std::move(s);
+        if (previous) {
+            previous->flush();
+        }
+    }
+# endif
+
+private:
+# if DEBUG_SINKS
+    // intentionally leaked, so that debug() in static destructors is safe
+    struct debug_sink_registry {
+        std::mutex mutex;
+        std::shared_ptr<sink> installed;
+    };
+
+    // writers count themselves under the epoch they started in, set_sink()
+    // moves to the next epoch and waits for the writers of the last one
+    struct debug_sink_epoch_gate {
+        std::atomic<unsigned> epoch;
+        std::atomic<std::size_t> writers[2];
+    };
+
+    static debug_sink_epoch_gate &debug_sink_gate() noexcept {
+        static debug_sink_epoch_gate gate;
+        return gate;
+    }
+
+    // keeps the current sink alive while it is used, an epoch that moved
+    // on before the writer was counted is retried
+    struct debug_sink_pin {
+        std::atomic<std::size_t> *writers;
+
+        debug_sink_pin() noexcept {
+            auto &gate = debug_sink_gate();
+            for (;;) {
+                unsigned epoch = gate.epoch.load();
+                writers = &gate.writers[epoch & 1];
+                writers->fetch_add(1);
+                if (gate.epoch.load() == epoch) {
+                    DEBUG_LIKELY {
+                        break;
+                    }
+                }
+                writers->fetch_sub(1, std::memory_order_release);
+            }
+        }
+
+        debug_sink_pin(debug_sink_pin &&) = delete;
+
+        ~debug_sink_pin() {
+            writers->fetch_sub(1, std::memory_order_release);
+        }
+    };
+
+    // the first 64 bytes of an mmap_ring_sink file, in native byte order,
+    // cursor counts all bytes ever written, so the next write goes to
+    // cursor % capacity, and the ring has wrapped cursor / capacity times
+    struct debug_ring_header {
+        char magic[8];
+        std::uint64_t capacity;
+        std::uint64_t cursor;
+        std::uint64_t reserved[5];
+    };
+
+    static std::atomic<sink *> &debug_sink_current() noexcept {
+        static std::atomic<sink *> current{nullptr};
+        return current;
+    }
+
+    static int debug_sink_open(std::string const &path) {
+        int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+                        0644);
+        if (fd < 0) {
+            throw std::system_error(errno, std::generic_category(), path);
+        }
+        return fd;
+    }
+
+    static void debug_sink_writev(int fd, ::iovec *iov, int n) {
+        while (n > 0) {
+            if (iov->iov_len == 0) {
+                ++iov;
+                --n;
+                continue;
+            }
+            ::ssize_t w = ::writev(fd, iov, n);
+            if (w < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return;
+            }
+            std::size_t done = static_cast<std::size_t>(w);
+            while (n > 0 && done >= iov->iov_len) {
+                done -= iov->iov_len;
+                ++iov;
+                --n;
+            }
+            if (n > 0) {
+                iov->iov_base = static_cast<char *>(iov->iov_base) + done;
+                iov->iov_len -= done;
+            }
+        }
+    }
+
+    static void debug_sink_shutdown() {
+        flush();
+    }
+# endif
+
+    static void debug_sink_flush() {
+# if DEBUG_SINKS
+        debug_sink_pin pin;
+        if (sink *s = debug_sink_current().load()) {
+            s->flush();
+        }
+# endif
+    }
+
+private:
+    // the state of one debug() call site, created the first time a call
+    // there needs it, and never freed
+    struct debug_call_site {
+        char const *file;
+        std::uint32_t line;
+        std::uint32_t column;
+        char const *function;
+        std::atomic<debug_call_site *> next{nullptr};
+        // 1 enabled, 0 disabled, -1 the rules changed, see debug_call_site_on
+        std::atomic<int> enabled{1};
+# if DEBUG_ENABLE_FILES_MATCH
+        bool files_match = true;
+# endif
+        std::atomic<std::uint64_t> calls{0};
+        std::atomic<std::uint64_t> printed{0};
+        // the second of rate_per_sec (plus 1) above the calls in it, so that
+        // a new second and its first call are one compare-and-swap
+        std::atomic<std::uint64_t> rate{0};
+        // the location mark of every line from here, see debug_format_marks
+        std::string const prefix;
+# if DEBUG_COALESCE
+        // the last line output from here, and how often it was repeated
+        std::mutex coalesce_mutex;
+        std::uint64_t last_hash = 0;
+        std::int64_t last_time = 0;
+        std::uint64_t repeats = 0;
+# endif
+
+        debug_call_site(char const *file, std::uint32_t line,
+                        std::uint32_t column, char const *function)
+            : file(file),
+              line(line),
+              column(column),
+              function(function),
+              prefix(debug_location_prefix(file, line)) {}
+    };
+
+    // lookups are lock-free, the mutex only serializes insertions and rule
+    // changes, the list of sites can be walked lock-free (in signal handlers)
+    struct debug_call_site_table {
+        std::atomic<debug_call_site *> slots[DEBUG_CALL_SITE_TABLE_SIZE];
+        std::mutex mutex;
+        std::atomic<debug_call_site *> sites{nullptr};
+        std::atomic<debug_call_site *> *last = &sites;
+# if DEBUG_CALL_SITE_CONTROL
+        std::string env_rules;
+        std::string file_rules;
+        std::string api_rules;
+        char const *control_file = nullptr;
+        std::atomic<bool> reload{false};
+# endif
+
+        debug_call_site_table() noexcept {
+            for (auto &slot: slots) {
+                slot.store(nullptr, std::memory_order_relaxed);
+            }
+        }
+    };
+
+    static_assert((DEBUG_CALL_SITE_TABLE_SIZE &
+                   (DEBUG_CALL_SITE_TABLE_SIZE - 1)) == 0,
+                  "DEBUG_CALL_SITE_TABLE_SIZE must be a power of two");
+
+# if DEBUG_CALL_SITE_CONTROL
+    using debug_sighup_handler = void (*)(int);
+
+    static debug_sighup_handler &debug_call_site_previous_sighup() noexcept {
+        static debug_sighup_handler previous = SIG_DFL;
+        return previous;
+    }
+
+# endif
+    static debug_call_site_table &debug_call_site_instance() {
+        // intentionally leaked, so that debug() in static destructors is safe
+        static debug_call_site_table *instance = [] {
+            auto *t = new debug_call_site_table();
+# if DEBUG_SAMPLING_SUMMARY
+            std::atexit(debug_call_site_summary);
+# endif
+# if DEBUG_COALESCE
+            std::atexit(debug_coalesce_summary);
+# endif
+# if DEBUG_CALL_SITE_CONTROL
+            if (char const *rules = std::getenv("DEBUG_SITES")) {
+                t->env_rules = rules;
+            }
+            t->control_file = std::getenv("DEBUG_SITES_FILE");
+            if (t->control_file) {
+                t->file_rules = debug_call_site_read_file(t->control_file);
+#  ifdef SIGHUP
+                debug_sighup_handler previous =
+                    std::signal(SIGHUP, debug_call_site_sighup);
+                if (previous != SIG_ERR) {
+                    debug_call_site_previous_sighup() = previous;
+                }
+#  endif
+            }
+# endif
+            return t;
+        }();
+        return *instance;
+    }
+# if DEBUG_CALL_SITE_CONTROL || DEBUG_ENABLE_FILES_MATCH
+
+    // '*' matches any run of characters, '?' any single character
+    static bool debug_glob_match(char const *p, char const *pe,
+                                 char const *s, char const *se) noexcept {
+        char const *star = nullptr;
+        char const *retry = s;
+        while (s != se) {
+            if (p != pe && (*p == '?' || *p == *s)) {
+                ++p;
+                ++s;
+            } else if (p != pe && *p == '*') {
+                star = p++;
+                retry = s;
+            } else if (star) {
+                p = star + 1;
+                s = ++retry;
+            } else {
+                return false;
+            }
+        }
+        while (p != pe && *p == '*') {
+            ++p;
+        }
+        return p == pe;
+    }
+
+    static bool debug_glob_match(char const *p, char const *pe,
+                                 char const *s) noexcept {
+        return debug_glob_match(p, pe, s, s + std::strlen(s));
+    }
+# endif
+# if DEBUG_ENABLE_FILES_MATCH
+
+    // DEBUG_FILES parsed once, entries are separated by spaces, commas or
+    // semicolons: globs (containing '*' or '?') match the path or base name,
+    // entries ending with '/' match every file under that directory, others
+    // match the path, the base name or any trailing part of the path
+    struct debug_files_matcher {
+        bool all = true;
+        std::unordered_set<std::string> names;
+        std::vector<std::string> dirs;
+        std::vector<std::string> globs;
+
+        explicit debug_files_matcher(char const *files) {
+            if (!files) {
+                return;
+            }
+            all = false;
+            for (char const *p = files; *p;) {
+                if (*p == ' ' || *p == ',' || *p == ';' || *p == '\t' ||
+                    *p == '\n') {
+                    ++p;
+                    continue;
+                }
+                char const *pe = p;
+                bool glob = false;
+                while (*pe && *pe != ' ' && *pe != ',' && *pe != ';' &&
+                       *pe != '\t' && *pe != '\n') {
+                    glob = glob || *pe == '*' || *pe == '?';
+                    ++pe;
+                }
+                std::string entry(p, pe);
+                if (glob) {
+                    globs.push_back(std::move(entry));
+                } else if (entry.back() == '/') {
+                    dirs.push_back(std::move(entry));
+                } else {
+                    names.insert(std::move(entry));
+                }
+                p = pe;
+            }
+        }
+
+        bool match(char const *file) const {
+            if (all) {
+                return true;
+            }
+            std::size_t n = std::strlen(file);
+            char const *fn = file;
+            for (char const *fp = file; *fp; ++fp) {
+                if (*fp == '/') {
+                    fn = fp + 1;
+                }
+            }
+            if (!names.empty()) {
+                if (names.count(std::string(file, n))) {
+                    return true;
+                }
+                for (char const *fp = file; *fp; ++fp) {
+                    if (*fp == '/' && names.count(std::string(fp + 1))) {
+                        return true;
+                    }
+                }
+            }
+            DEBUG_STRING_VIEW path(file);
+            for (auto const &dir: dirs) {
+                if (path.compare(0, dir.size(), dir) == 0 ||
+                    path.find("/" + dir) != path.npos) {
+                    return true;
+                }
+            }
+            for (auto const &glob: globs) {
+                char const *g = glob.data();
+                if (debug_glob_match(g, g + glob.size(), file, file + n) ||
+                    debug_glob_match(g, g + glob.size(), fn)) {
+                    return true;
+                }
+            }
+            return false;
+        }
+    };
+
+    static bool file_detected(char const *file) {
+        // intentionally leaked, so that debug() in static destructors is safe
+        static debug_files_matcher const *matcher =
+            new debug_files_matcher(std::getenv("DEBUG_FILES"));
+        return matcher->match(file);
+    }
+# endif
+# if DEBUG_CALL_SITE_CONTROL
+
+    // rules are separated by spaces, commas or newlines, each one is a glob
+    // of the file path or base name, or of the function name when it ends
+    // with "()", prefixed by '-' to disable matched sites, the last matching
+    // rule wins, unmatched sites are enabled unless the first rule enables
+    static bool debug_call_site_match(std::string const &rules,
+                                      debug_call_site const &site,
+                                      bool &first, bool &enabled) noexcept {
+        char const *fn = site.file;
+        for (char const *fp = fn; *fp; ++fp) {
+            if (*fp == '/') {
+                fn = fp + 1;
+            }
+        }
+        bool matched = false;
+        char const *p = rules.c_str();
+        while (*p) {
+            if (*p == ' ' || *p == ',' || *p == '\t' || *p == '\n' ||
+                *p == '\r' || *p == '#') {
+                if (*p == '#') {
+                    while (*p && *p != '\n') {
+                        ++p;
+                    }
+                } else {
+                    ++p;
+                }
+                continue;
+            }
+            bool on = true;
+            if (*p == '-' || *p == '+') {
+                on = *p++ == '+';
+            }
+            char const *pe = p;
+            while (*pe && *pe != ' ' && *pe != ',' && *pe != '\t' &&
+                   *pe != '\n' && *pe != '\r') {
+                ++pe;
+            }
+            if (first) {
+                first = false;
+                enabled = !on;
+            }
+            bool hit;
+            if (pe - p >= 2 && pe[-2] == '(' && pe[-1] == ')') {
+                hit = site.function &&
+                      debug_glob_match(p, pe - 2, site.function);
+            } else {
+                hit = debug_glob_match(p, pe, site.file) ||
+                      debug_glob_match(p, pe, fn);
+            }
+            if (hit) {
+                enabled = on;
+                matched = true;
+            }
+            p = pe;
+        }
+        return matched;
+    }
+
+    // must be called with the table mutex locked
+    static void debug_call_site_apply(debug_call_site_table &table,
+                                      debug_call_site &site) noexcept {
+        bool first = true;
+        bool enabled = true;
+        debug_call_site_match(table.env_rules, site, first, enabled);
+        debug_call_site_match(table.file_rules, site, first, enabled);
+        debug_call_site_match(table.api_rules, site, first, enabled);
+#  if DEBUG_ENABLE_FILES_MATCH
+        enabled = enabled && site.files_match;
+#  endif
+        site.enabled.store(enabled ? 1 : 0, std::memory_order_relaxed);
+    }
+
+    // must be called with the table mutex locked
+    static void debug_call_site_apply_all(debug_call_site_table &table) {
+        while (table.reload.exchange(false)) {
+            table.file_rules = debug_call_site_read_file(table.control_file);
+        }
+        for (debug_call_site *site =
+                 table.sites.load(std::memory_order_relaxed);
+             site; site = site->next.load(std::memory_order_relaxed)) {
+            debug_call_site_apply(table, *site);
+        }
+    }
+
+    static std::string debug_call_site_read_file(char const *path) {
+        std::ifstream file(path);
+        return std::string(std::istreambuf_iterator<char>(file),
+                           std::istreambuf_iterator<char>());
+    }
+
+    // async-signal-safe: only atomic stores, the control file is re-read by
+    // the next debug() call that sees its site marked
+    static void debug_call_site_sighup(int sig) {
+        debug_call_site_table &table = debug_call_site_instance();
+        table.reload.store(true);
+        for (debug_call_site *site =
+                 table.sites.load(std::memory_order_acquire);
+             site; site = site->next.load(std::memory_order_acquire)) {
+            site->enabled.store(-1, std::memory_order_relaxed);
+        }
+        // a handler the program installed before ours still gets the signal,
+        // only the default action (terminating) is replaced
+        debug_sighup_handler previous = debug_call_site_previous_sighup();
+        if (previous != SIG_DFL && previous != SIG_IGN) {
+            previous(sig);
+        }
+    }
+
+# endif
+# if DEBUG_CALL_SITE_CONTROL || DEBUG_ENABLE_FILES_MATCH
+
+    // the slow path of a site whose flag is not 1
+    static bool debug_call_site_refresh(debug_call_site &site) {
+#  if DEBUG_CALL_SITE_CONTROL
+        if (site.enabled.load(std::memory_order_relaxed) < 0) {
+            debug_call_site_table &table = debug_call_site_instance();
+            std::lock_guard<std::mutex> lock(table.mutex);
+            debug_call_site_apply_all(table);
+        }
+#  endif
+        return site.enabled.load(std::memory_order_relaxed) == 1;
+    }
+# endif
+
+    static std::size_t debug_call_site_hash(char const *file,
+                                            std::uint32_t line,
+                                            std::uint32_t column) noexcept {
+        std::uint64_t h = static_cast<std::uint64_t>(
+            reinterpret_cast<std::uintptr_t>(file));
+        h ^= (static_cast<std::uint64_t>(line) << 32) | column;
+        h *= 0x9E3779B97F4A7C15u;
+        return static_cast<std::size_t>(h >> 32);
+    }
+
+    static debug_call_site &
+    debug_call_site_of(DEBUG_SOURCE_LOCATION const &loc) {
+        char const *file = loc.file_name();
+        auto line = static_cast<std::uint32_t>(loc.line());
+        auto column = static_cast<std::uint32_t>(loc.column());
+        // the site this thread looked up last, a loop around one debug()
+        // (however disabled) finds it without touching the shared table
+        static thread_local debug_call_site *last = nullptr;
+        if (last && last->file == file && last->line == line &&
+            last->column == column) {
+            DEBUG_LIKELY {
+                return *last;
+            }
+        }
+        last = &debug_call_site_lookup(file, line, column,
+                                       loc.function_name());
+        return *last;
+    }
+
+    // nullptr when the site cannot be registered (out of memory), the line
+    // is then printed as if there were no rules
+    static debug_call_site *
+    debug_call_site_find(DEBUG_SOURCE_LOCATION const &loc) noexcept {
+        try {
+            return &debug_call_site_of(loc);
+        } catch (...) {
+            return nullptr;
+        }
+    }
+
+    static debug_call_site &debug_call_site_lookup(char const *file,
+                                                   std::uint32_t line,
+                                                   std::uint32_t column,
+                                                   char const *function) {
+        debug_call_site_table &table = debug_call_site_instance();
+        std::size_t const mask = DEBUG_CALL_SITE_TABLE_SIZE - 1;
+        std::size_t h = debug_call_site_hash(file, line, column);
+        for (std::size_t i = 0; i <= mask; ++i) {
+            debug_call_site *site =
+                table.slots[(h + i) & mask].load(std::memory_order_acquire);
+            if (!site) {
+                break;
+            }
+            if (site->file == file && site->line == line &&
+                site->column == column) {
+                DEBUG_LIKELY {
+                    return *site;
+                }
+            }
+        }
+        std::lock_guard<std::mutex> lock(table.mutex);
+        for (debug_call_site *site =
+                 table.sites.load(std::memory_order_relaxed);
+             site; site = site->next.load(std::memory_order_relaxed)) {
+            if (site->file == file && site->line == line &&
+                site->column == column) {
+                return *site;
+            }
+        }
+        auto *site = new debug_call_site(file, line, column, function);
+# if DEBUG_ENABLE_FILES_MATCH
+        site->files_match = file_detected(file);
+        site->enabled.store(site->files_match ? 1 : 0,
+                            std::memory_order_relaxed);
+# endif
+# if DEBUG_CALL_SITE_CONTROL
+        // a SIGHUP not yet seen by any site still changes the rules
+        if (table.reload.load()) {
+            debug_call_site_apply_all(table);
+        }
+        debug_call_site_apply(table, *site);
+# endif
+        table.last->store(site, std::memory_order_release);
+        table.last = &site->next;
+        for (std::size_t i = 0; i <= mask; ++i) {
+            auto &slot = table.slots[(h + i) & mask];
+            if (!slot.load(std::memory_order_relaxed)) {
+                slot.store(site, std::memory_order_release);
+                break;
+            }
+        }
+        return *site;
+    }
+
+    static void debug_call_site_summary() {
+        debug_call_site_table &table = debug_call_site_instance();
+        std::lock_guard<std::mutex> lock(table.mutex);
+        std::string msg;
+        for (debug_call_site *site =
+                 table.sites.load(std::memory_order_relaxed);
+             site; site = site->next.load(std::memory_order_relaxed)) {
+            std::uint64_t calls = site->calls.load(std::memory_order_relaxed);
+            std::uint64_t printed =
+                site->printed.load(std::memory_order_relaxed);
+            if (calls <= printed) {
+                continue;
+            }
+            char const *fn = site->file;
+            for (char const *fp = fn; *fp; ++fp) {
+                if (*fp == '/') {
+                    fn = fp + 1;
+                }
+            }
+            msg += "debug: ";
+            msg += fn;
+            msg += DEBUG_SEPARATOR_FILE;
+            msg += std::to_string(site->line);
+            msg += DEBUG_SEPARATOR_LINE;
+            msg += ' ';
+            msg += std::to_string(calls - printed);
+            msg += " of ";
+            msg += std::to_string(calls);
+            msg += " lines suppressed\n";
+        }
+        if (!msg.empty()) {
+            flush();
+            debug_output(msg.data(), msg.size());
+            debug_sink_flush();
+        }
+    }
+# if DEBUG_COALESCE
+
+    // the formatted arguments are hashed right after each is formatted,
+    // while still in cache, a word at a time
+    static std::uint64_t debug_hash_bytes(std::uint64_t h, char const *p,
+                                          std::size_t n) noexcept {
+        std::uint64_t const m = 0x9e3779b97f4a7c15ULL;
+        h = (h ^ n) * m;
+        for (; n >= 8; p += 8, n -= 8) {
+            std::uint64_t w;
+            std::memcpy(&w, p, 8);
+            h = (h ^ w) * m;
+            h ^= h >> 32;
+        }
+        std::uint64_t w = 0;
+        std::memcpy(&w, p, n);
+        h = (h ^ w) * m;
+        return h ^ (h >> 29);
+    }
+
+    static std::string debug_coalesce_message(debug_call_site const &site,
+                                              std::uint64_t repeats) {
+        char const *fn = site.file;
+        for (char const *fp = fn; *fp; ++fp) {
+            if (*fp == '/') {
+                fn = fp + 1;
+            }
+        }
+        std::string msg = "debug: ";
+        msg += fn;
+        msg += DEBUG_SEPARATOR_FILE;
+        msg += std::to_string(site.line);
+        msg += DEBUG_SEPARATOR_LINE;
+        msg += " last message repeated ";
+        msg += std::to_string(repeats);
+        msg += " times\n";
+        return msg;
+    }
+
+    // false if the line repeats the last one from this call site
+    bool debug_coalesce() {
+        if (!call_site) {
+            call_site = &debug_call_site_of(loc);
+        }
+        debug_call_site &site = *call_site;
+        std::int64_t now =
+            std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now().time_since_epoch())
+                .count();
+        std::uint64_t repeats;
+        {
+            std::lock_guard<std::mutex> lock(site.coalesce_mutex);
+            if (hash == site.last_hash &&
+                now - site.last_time < DEBUG_COALESCE) {
+                DEBUG_LIKELY {
+                    ++site.repeats;
+                    return false;
+                }
+            }
+            repeats = site.repeats;
+            site.repeats = 0;
+            site.last_hash = hash;
+            site.last_time = now;
+        }
+        if (repeats) {
+            std::string msg = debug_coalesce_message(site, repeats);
+            debug_emit(msg.data(), msg.size());
+        }
+        return true;
+    }
+
+    static void debug_coalesce_summary() {
+        debug_call_site_table &table = debug_call_site_instance();
+        std::string msg;
+        for (debug_call_site *site =
+                 table.sites.load(std::memory_order_acquire);
+             site; site = site->next.load(std::memory_order_acquire)) {
+            std::lock_guard<std::mutex> lock(site->coalesce_mutex);
+            if (site->repeats) {
+                msg += debug_coalesce_message(*site, site->repeats);
+                site->repeats = 0;
+            }
+        }
+        if (!msg.empty()) {
+            flush();
+            debug_output(msg.data(), msg.size());
+            debug_sink_flush();
+        }
+    }
+# endif
+# if DEBUG_CALL_SITE_CONTROL
+
+public:
+    struct call_site_info {
+        char const *file;
+        int line;
+        char const *function;
+        bool enabled;
+    };
+
+    // replaces the rules of the previous call, these are applied after the
+    // ones from DEBUG_SITES and DEBUG_SITES_FILE, e.g. "-*.cpp +main.cpp"
+    static void set_sites(std::string rules) {
+        debug_call_site_table &table = debug_call_site_instance();
+        std::lock_guard<std::mutex> lock(table.mutex);
+        table.api_rules = std::move(rules);
+        debug_call_site_apply_all(table);
+    }
+
+    // every call site executed so far
+    static std::vector<call_site_info> call_sites() {
+        debug_call_site_table &table = debug_call_site_instance();
+        std::lock_guard<std::mutex> lock(table.mutex);
+        debug_call_site_apply_all(table);
+        std::vector<call_site_info> ret;
+        for (debug_call_site *site =
+                 table.sites.load(std::memory_order_relaxed);
+             site; site = site->next.load(std::memory_order_relaxed)) {
+            ret.push_back({site->file, static_cast<int>(site->line),
+                           site->function,
+                           site->enabled.load(std::memory_order_relaxed) ==
+                               1});
+        }
+        return ret;
+    }
+
+private:
+# else
+
+public:
+    struct call_site_info {
+        char const *file;
+        int line;
+        char const *function;
+        bool enabled;
+    };
+
+    // every call site stays enabled without DEBUG_CALL_SITE_CONTROL
+    static void set_sites(std::string const &) {}
+
+    static std::vector<call_site_info> call_sites() {
+        return {};
+    }
+
+private:
+# endif
+
+    debug_line_stream_lease oss_lease;
+    debug_line_stream &oss;
+# if DEBUG_JSON
+    // the JSON object of the line, oss holds the text of its message
+    debug_line_stream_lease json_lease;
+    debug_line_stream &json;
+# endif
+
+    enum {
+        silent = 0,
+        print = 1,
+        panic = 2,
+        supress = 3,
+    } state;
+# if DEBUG_DEFERRED
+    bool deferred = false;
+# endif
+
+    DEBUG_SOURCE_LOCATION loc;
+    debug_call_site *call_site = nullptr;
+    std::uint64_t call_index = 0;
+    bool sampled = false;
+# if DEBUG_COALESCE
+    std::uint64_t hash = 0;
+# endif
+# if DEBUG_SHOW_TIMESTAMP == 2
+#  if __cpp_inline_variables
+    static inline std::chrono::steady_clock::time_point const tp0 =
+        std::chrono::steady_clock::now();
+#  endif
+# elif DEBUG_SHOW_TIMESTAMP == 3
+    // the CPU cycle counter, the same one as tinybench::now()
+    static std::int64_t debug_cycles() noexcept {
+#  if defined(_M_AMD64) || defined(_M_IX86) || defined(__x86_64__) || \
+      defined(__i386__)
+        return static_cast<std::int64_t>(__rdtsc());
+#  elif defined(__aarch64__) && defined(__GNUC__)
+        std::int64_t t;
+        __asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(t));
+        return t;
+#  else
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+#  endif
+    }
+
+    // the counter and steady_clock at startup, taken without waiting
+    struct debug_cycle_clock {
+        std::int64_t cycles0;
+        std::chrono::steady_clock::time_point t0;
+    };
+
+    static debug_cycle_clock debug_cycle_clock_start() noexcept {
+        return {debug_cycles(), std::chrono::steady_clock::now()};
+    }
+
+    // calibrated by the first timestamped line, against steady_clock over
+    // the time since startup (waiting for 2 ms to pass if it is earlier),
+    // cntvct_el0 reports its own frequency
+    static double
+    debug_cycle_clock_calibrate(debug_cycle_clock const &clock) noexcept {
+#  if defined(__aarch64__) && defined(__GNUC__)
+        (void)clock;
+        std::int64_t freq;
+        __asm__ __volatile__("mrs %0, cntfrq_el0" : "=r"(freq));
+        return 1e9 / static_cast<double>(freq);
+#  else
+        auto t1 = std::chrono::steady_clock::now();
+        while (t1 - clock.t0 < std::chrono::milliseconds(2)) {
+            t1 = std::chrono::steady_clock::now();
+        }
+        std::int64_t cycles = debug_cycles() - clock.cycles0;
+        return static_cast<double>(
+                   std::chrono::duration_cast<std::chrono::nanoseconds>(
+                       t1 - clock.t0)
+                       .count()) /
+               static_cast<double>(cycles > 0 ? cycles : 1);
+#  endif
+    }
+#  if __cpp_inline_variables
+    static inline debug_cycle_clock const cycle_clock =
+        debug_cycle_clock_start();
+#  endif
+# endif
+    // the time of a line is captured as a plain integer, so that it can be
+    // rendered later by DEBUG_DEFERRED: microseconds since epoch for
+    // DEBUG_SHOW_TIMESTAMP == 1, nanoseconds since startup for == 2 and 3
+    static std::int64_t debug_timestamp_now() noexcept {
 # if DEBUG_SHOW_TIMESTAMP == 1
-#  ifdef DEBUG_HAS_SYS_TIME_H
+#  if DEBUG_TIMESTAMP_COARSE && defined(CLOCK_REALTIME_COARSE)
+        // served from the vDSO without a syscall, at tick resolution
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+        return static_cast<std::int64_t>(ts.tv_sec) * 1000000 +
+               ts.tv_nsec / 1000;
+#  elif defined(DEBUG_HAS_SYS_TIME_H)
         struct timeval tv;
         gettimeofday(&tv, nullptr);
-        std::tm now = *std::localtime(&tv.tv_sec);
-        oss << std::put_time(&now, "%H:%M:%S.");
-        auto flags = oss.flags();
-        oss << std::setw(3) << std::setfill('0');
-        oss << (tv.tv_usec / 1000) % 1000;
-        oss.flags(flags);
+        return static_cast<std::int64_t>(tv.tv_sec) * 1000000 + tv.tv_usec;
 #  else
-        auto tp = std::chrono::system_clock::now();
-        std::time_t t = std::chrono::system_clock::to_time_t(tp);
-        std::tm now = *std::gmtime(&t);
-        oss << std::put_time(&now, "%H:%M:%S.");
-        auto flags = oss.flags();
-        oss << std::setw(3) << std::setfill('0');
-        oss << std::chrono::duration_cast<std::chrono::milliseconds>(
-                   tp.time_since_epoch())
-                       .count() %
-                   1000;
-        oss.flags(flags);
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+                   std::chrono::system_clock::now().time_since_epoch())
+            .count();
 #  endif
-        oss << ' ';
 # elif DEBUG_SHOW_TIMESTAMP == 2
 #  if __cpp_inline_variables
         auto dur = std::chrono::steady_clock::now() - tp0;
@@ -1351,8 +4724,353 @@ private:
             std::chrono::steady_clock::now();
         auto dur = std::chrono::steady_clock::now() - tp0;
 #  endif
-        auto elapsed =
-            std::chrono::duration_cast<std::chrono::milliseconds>(dur).count();
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(dur)
+            .count();
+# elif DEBUG_SHOW_TIMESTAMP == 3
+#  if !__cpp_inline_variables
+        static debug_cycle_clock const cycle_clock = debug_cycle_clock_start();
+#  endif
+        std::int64_t cycles = debug_cycles();
+        static double const ns_per_cycle =
+            debug_cycle_clock_calibrate(cycle_clock);
+        return static_cast<std::int64_t>(
+            static_cast<double>(cycles - cycle_clock.cycles0) * ns_per_cycle);
+# else
+        return 0;
+# endif
+    }
+
+# if DEBUG_SHOW_THREAD_ID
+    // threads are numbered 1, 2, 3... in the order they first print
+    static std::uint32_t debug_thread_now() noexcept {
+        static thread_local std::uint32_t id = 0;
+        if (!id) {
+            DEBUG_UNLIKELY {
+                static std::atomic<std::uint32_t> next{0};
+                id = next.fetch_add(1, std::memory_order_relaxed) + 1;
+            }
+        }
+        return id;
+    }
+
+    struct debug_thread_names {
+        std::mutex mutex;
+        std::vector<std::string> names;
+    };
+
+    static debug_thread_names &debug_thread_names_instance() {
+        // intentionally leaked, so that debug() in static destructors is safe
+        static debug_thread_names *instance = new debug_thread_names();
+        return *instance;
+    }
+
+    // bumped by every set_thread_name(), so that cached labels are redone
+    static std::atomic<std::uint32_t> &debug_thread_names_version() noexcept {
+        static std::atomic<std::uint32_t> version{0};
+        return version;
+    }
+
+    // "[3] " or "[3:worker] ", rendered once, and kept by each thread for
+    // the last thread it has printed (itself, unless it renders lines of
+    // others, like the DEBUG_ASYNC background thread does)
+    struct debug_thread_label {
+        std::uint32_t id;
+        std::uint32_t version;
+        std::size_t size;
+        char text[48];
+    };
+
+    static debug_thread_label const &debug_thread_label_of(std::uint32_t id) {
+        static thread_local debug_thread_label label = {0, 0, 0, {}};
+        std::uint32_t version =
+            debug_thread_names_version().load(std::memory_order_acquire);
+        if (label.id != id || label.version != version || !label.size) {
+            DEBUG_UNLIKELY {
+                std::size_t n = 0;
+                label.text[n++] = '[';
+                char digits[10];
+                std::size_t d = 0;
+                for (std::uint32_t i = id; d == 0 || i != 0; i /= 10) {
+                    digits[d++] = static_cast<char>('0' + i % 10);
+                }
+                while (d != 0) {
+                    label.text[n++] = digits[--d];
+                }
+                if (version != 0) {
+                    debug_thread_names &t = debug_thread_names_instance();
+                    std::lock_guard<std::mutex> lock(t.mutex);
+                    if (id < t.names.size() && !t.names[id].empty()) {
+                        std::string const &name = t.names[id];
+                        std::size_t len = name.size();
+                        if (len > sizeof(label.text) - n - 3) {
+                            len = sizeof(label.text) - n - 3;
+                        }
+                        label.text[n++] = ':';
+                        std::memcpy(label.text + n, name.data(), len);
+                        n += len;
+                    }
+                }
+                label.text[n++] = ']';
+                label.text[n++] = ' ';
+                label.id = id;
+                label.version = version;
+                label.size = n;
+            }
+        }
+        return label;
+    }
+
+public:
+    // shown after the number of this thread in its lines, e.g. "[3:worker]"
+    static void set_thread_name(std::string const &name) {
+        std::uint32_t id = debug_thread_now();
+        debug_thread_names &t = debug_thread_names_instance();
+        {
+            std::lock_guard<std::mutex> lock(t.mutex);
+            if (t.names.size() <= id) {
+                t.names.resize(id + 1);
+            }
+            t.names[id] = name;
+        }
+        debug_thread_names_version().fetch_add(1, std::memory_order_release);
+    }
+
+private:
+# else
+    static int debug_thread_now() noexcept {
+        return 0;
+    }
+
+public:
+    // thread names are not shown without DEBUG_SHOW_THREAD_ID
+    static void set_thread_name(std::string const &) {}
+
+private:
+# endif
+
+# if DEBUG_SHOW_SOURCE_CODE_LINE
+    // a source file mapped (or read) once for the whole process, with the
+    // offset of every line, so that any line is found in O(1)
+    struct debug_source_file {
+        char const *data = nullptr;
+        std::size_t size = 0;
+        std::vector<std::size_t> starts;
+#  ifndef DEBUG_HAS_MMAP
+        std::string storage;
+#  endif
+
+        // [b, e) is the line without its '\n', false if empty or past the end
+        bool line(std::uint32_t n, char const *&b, char const *&e) const {
+            if (n == 0 || n >= starts.size()) {
+                return false;
+            }
+            b = data + starts[n - 1];
+            e = data + starts[n] - 1;
+            return b != e;
+        }
+
+        void index() {
+            starts.push_back(0);
+            std::size_t i = 0;
+#  if DEBUG_HAS_SSE2
+            __m128i const nl = _mm_set1_epi8('\n');
+            for (; i + 16 <= size; i += 16) {
+                __m128i x = _mm_loadu_si128(
+                    reinterpret_cast<__m128i const *>(data + i));
+                auto bits = static_cast<std::uint32_t>(
+                    _mm_movemask_epi8(_mm_cmpeq_epi8(x, nl)));
+                while (bits) {
+                    starts.push_back(i + debug_ctz(bits) + 1);
+                    bits &= bits - 1;
+                }
+            }
+#  endif
+            for (; i < size; ++i) {
+                if (data[i] == '\n') {
+                    starts.push_back(i + 1);
+                }
+            }
+            // a last line without '\n' still ends at size
+            if (starts.back() != size) {
+                starts.push_back(size + 1);
+            }
+        }
+    };
+
+    static debug_source_file *debug_source_load(char const *path) {
+        std::unique_ptr<debug_source_file> file(new debug_source_file());
+#  ifdef DEBUG_HAS_MMAP
+        int fd = ::open(path, O_RDONLY);
+        if (fd < 0) {
+            return nullptr;
+        }
+        struct stat st;
+        if (::fstat(fd, &st) != 0) {
+            ::close(fd);
+            return nullptr;
+        }
+        file->size = static_cast<std::size_t>(st.st_size);
+        if (file->size) {
+            void *p =
+                ::mmap(nullptr, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p == MAP_FAILED) {
+                ::close(fd);
+                return nullptr;
+            }
+            file->data = static_cast<char const *>(p);
+        }
+        ::close(fd);
+#  else
+        std::ifstream in(path, std::ios::binary);
+        if (!in.is_open()) {
+            return nullptr;
+        }
+        file->storage.assign(std::istreambuf_iterator<char>(in),
+                             std::istreambuf_iterator<char>());
+        file->data = file->storage.data();
+        file->size = file->storage.size();
+#  endif
+        file->index();
+        return file.release();
+    }
+
+    // files are never unmapped, lookups by the (per translation unit)
+    // pointer of the file name only take a shared lock
+    struct debug_source_cache {
+        std::shared_mutex mutex;
+        std::unordered_map<char const *, debug_source_file const *> by_ptr;
+        std::unordered_map<std::string, debug_source_file const *> by_name;
+    };
+
+    static debug_source_file const *debug_source_open(char const *path) {
+        // intentionally leaked, so that debug() in static destructors is safe
+        static debug_source_cache *cache = new debug_source_cache();
+        {
+            std::shared_lock<std::shared_mutex> lock(cache->mutex);
+            auto it = cache->by_ptr.find(path);
+            if (it != cache->by_ptr.end()) {
+                DEBUG_LIKELY {
+                    return it->second;
+                }
+            }
+        }
+        std::unique_lock<std::shared_mutex> lock(cache->mutex);
+        auto it = cache->by_name.find(path);
+        debug_source_file const *file;
+        if (it != cache->by_name.end()) {
+            file = it->second;
+        } else {
+            file = debug_source_load(path);
+            cache->by_name.emplace(path, file);
+        }
+        cache->by_ptr.emplace(path, file);
+        return file;
+    }
+
+# endif
+# if DEBUG_SHOW_TIMESTAMP == 1
+    // seconds east of UTC at time t, the time zone is consulted at most once
+    // per 15 minutes (DST changes on such boundaries), the window and offset
+    // are packed into one atomic so readers never see a torn pair
+    static std::int64_t debug_utc_offset(std::int64_t t) noexcept {
+        static std::atomic<std::int64_t> cache{-1};
+        std::int64_t const bias = 0x40000;
+        std::int64_t window = t / 900;
+        std::int64_t c = cache.load(std::memory_order_relaxed);
+        if (c >= 0 && (c >> 20) == window) {
+            DEBUG_LIKELY {
+                return (c & 0xFFFFF) - bias;
+            }
+        }
+        std::int64_t offset = 0;
+#  ifdef DEBUG_HAS_SYS_TIME_H
+        std::time_t tt = static_cast<std::time_t>(t);
+        std::tm now;
+        if (localtime_r(&tt, &now)) {
+            offset = static_cast<std::int64_t>(now.tm_gmtoff);
+        }
+#  endif
+        if (window >= 0) {
+            cache.store((window << 20) | (offset + bias),
+                        std::memory_order_relaxed);
+        }
+        return offset;
+    }
+
+# endif
+    // "file.cpp:12:\t", built once per call site, see debug_call_site
+    static std::string debug_location_prefix(char const *file_name,
+                                             std::uint32_t line_number) {
+# if DEBUG_SHOW_LOCATION
+        char const *fn = file_name;
+        for (char const *fp = fn; *fp; ++fp) {
+            if (*fp == '/') {
+                fn = fp + 1;
+            }
+        }
+        std::ostringstream oss;
+        oss << fn << DEBUG_SEPARATOR_FILE << line_number << DEBUG_SEPARATOR_LINE
+            << DEBUG_SEPARATOR_TAB;
+        return oss.str();
+# else
+        (void)file_name;
+        (void)line_number;
+        return {};
+# endif
+    }
+
+    template <class Thread>
+    static void debug_format_marks(std::ostream &oss, char const *file_name,
+                                   std::uint32_t line_number,
+                                   std::int64_t timestamp,
+                                   Thread const &thread) {
+        debug_format_marks(oss, nullptr, file_name, line_number, timestamp,
+                           thread);
+    }
+
+    // location_mark is the prefix of the line's call site when it is known,
+    // without one the mark is formatted here
+    template <class Thread>
+    static void debug_format_marks(std::ostream &oss,
+                                   std::string const *location_mark,
+                                   char const *file_name,
+                                   std::uint32_t line_number,
+                                   std::int64_t timestamp,
+                                   Thread const &thread) {
+        (void)file_name;
+        (void)line_number;
+        (void)timestamp;
+        (void)thread;
+# if DEBUG_SHOW_TIMESTAMP == 1
+        std::int64_t sec = timestamp / 1000000;
+        // "HH:MM:SS." only changes once a second, each thread keeps its own
+        static thread_local std::int64_t prefix_sec = -1;
+        static thread_local char prefix[9];
+        if (sec != prefix_sec) {
+            DEBUG_UNLIKELY {
+                std::int64_t day = (sec + debug_utc_offset(sec)) % 86400;
+                if (day < 0) {
+                    day += 86400;
+                }
+                int hms[3] = {static_cast<int>(day / 3600),
+                              static_cast<int>(day / 60 % 60),
+                              static_cast<int>(day % 60)};
+                for (int i = 0; i < 3; ++i) {
+                    prefix[i * 3] = static_cast<char>('0' + hms[i] / 10);
+                    prefix[i * 3 + 1] = static_cast<char>('0' + hms[i] % 10);
+                    prefix[i * 3 + 2] = i == 2 ? '.' : ':';
+                }
+                prefix_sec = sec;
+            }
+        }
+        int ms = static_cast<int>(timestamp / 1000 % 1000);
+        char digits[4] = {static_cast<char>('0' + ms / 100),
+                          static_cast<char>('0' + ms / 10 % 10),
+                          static_cast<char>('0' + ms % 10), ' '};
+        oss.write(prefix, sizeof(prefix));
+        oss.write(digits, sizeof(digits));
+# elif DEBUG_SHOW_TIMESTAMP == 2
+        auto elapsed = timestamp / 1000000;
         auto flags = oss.flags();
         oss << std::setw(3) << std::setfill(' ');
         oss << (elapsed / 1000) % 1000;
@@ -1361,73 +5079,641 @@ private:
         oss << elapsed % 1000;
         oss.flags(flags);
         oss << ' ';
+# elif DEBUG_SHOW_TIMESTAMP == 3
+        std::int64_t frac = timestamp % 1000000000;
+        for (int i = DEBUG_TIMESTAMP_DIGITS; i < 9; ++i) {
+            frac /= 10;
+        }
+        auto flags = oss.flags();
+        oss << std::setw(3) << std::setfill(' ');
+        oss << (timestamp / 1000000000) % 1000;
+        oss << '.';
+        oss << std::setw(DEBUG_TIMESTAMP_DIGITS) << std::setfill('0');
+        oss << frac;
+        oss.flags(flags);
+        oss << ' ';
 # endif
 # if DEBUG_SHOW_THREAD_ID
-        oss << '[' << std::this_thread::get_id() << ']' << ' ';
+        debug_thread_label const &label =
+            debug_thread_label_of(static_cast<std::uint32_t>(thread));
+        oss.write(label.text, static_cast<std::streamsize>(label.size));
 # endif
-        char const *fn = loc.file_name();
-        for (char const *fp = fn; *fp; ++fp) {
-            if (*fp == '/') {
-                fn = fp + 1;
+        if (location_mark) {
+            oss.write(location_mark->data(),
+                      static_cast<std::streamsize>(location_mark->size()));
+        } else {
+# if DEBUG_SHOW_LOCATION
+            char const *fn = file_name;
+            for (char const *fp = fn; *fp; ++fp) {
+                if (*fp == '/') {
+                    fn = fp + 1;
+                }
+            }
+            oss.write(fn, static_cast<std::streamsize>(
+                              std::char_traits<char>::length(fn)));
+            oss << DEBUG_SEPARATOR_FILE;
+            char digits[10];
+            char *end = digits + sizeof(digits);
+            char *p = end;
+            std::uint32_t n = line_number;
+            do {
+                *--p = static_cast<char>('0' + n % 10);
+                n /= 10;
+            } while (n);
+            oss.write(p, end - p);
+            oss << DEBUG_SEPARATOR_LINE << DEBUG_SEPARATOR_TAB;
+# endif
+        }
+# if DEBUG_SHOW_SOURCE_CODE_LINE
+        if (debug_source_file const *file = debug_source_open(file_name)) {
+            DEBUG_LIKELY {
+                char const *b;
+                char const *e;
+                if (file->line(line_number, b, e)) {
+                    DEBUG_LIKELY {
+                        char const *p = b;
+                        while (p != e && (*p == ' ' || *p == '\t' ||
+                                          *p == '\r' || *p == '\n')) {
+                            ++p;
+                        }
+                        if (p != e) {
+                            b = p;
+                        }
+                        if (e[-1] == ';') {
+                            DEBUG_LIKELY {
+                                --e;
+                            }
+                        }
+                        oss << DEBUG_SOURCE_LINE_BRACE[0];
+                        oss.write(b, e - b);
+                        oss << DEBUG_SOURCE_LINE_BRACE[1];
+                    }
+                }
+            }
+        } else {
+            oss << DEBUG_SOURCE_LINE_BRACE[0] << '?'
+                << DEBUG_SOURCE_LINE_BRACE[1];
+        }
+# endif
+        oss << ' ';
+    }
+
+# if DEBUG_JSON
+    // the length of the well-formed UTF-8 sequence at p, 0 if it is not one
+    static std::size_t debug_utf8_length(char const *p, char const *end) {
+        auto c = static_cast<unsigned char>(*p);
+        if (c < 0x80) {
+            return 1;
+        }
+        std::size_t len = c < 0xc2   ? 0
+                          : c < 0xe0 ? 2
+                          : c < 0xf0 ? 3
+                          : c < 0xf5 ? 4
+                                     : 0;
+        if (len == 0 || static_cast<std::size_t>(end - p) < len) {
+            return 0;
+        }
+        for (std::size_t i = 1; i < len; ++i) {
+            if ((static_cast<unsigned char>(p[i]) & 0xc0) != 0x80) {
+                return 0;
+            }
+        }
+        // overlong forms, UTF-16 surrogates and code points past U+10FFFF
+        auto d = static_cast<unsigned char>(p[1]);
+        if ((c == 0xe0 && d < 0xa0) || (c == 0xed && d >= 0xa0) ||
+            (c == 0xf0 && d < 0x90) || (c == 0xf4 && d >= 0x90)) {
+            return 0;
+        }
+        return len;
+    }
+
+    // invalid UTF-8 bytes are replaced by U+FFFD, so the output stays JSON
+    static void debug_json_quote(std::ostream &os, char const *p,
+                                 std::size_t n) {
+        static char const hex[] = "0123456789abcdef";
+        char const *end = p + n;
+        os << '"';
+        while (p != end) {
+            char const *q = p;
+            while (q != end && *q != '"' && *q != '\\' &&
+                   static_cast<unsigned char>(*q) >= 0x20 &&
+                   static_cast<unsigned char>(*q) < 0x80) {
+                ++q;
+            }
+            if (q != p) {
+                os.write(p, q - p);
+            }
+            if (q == end) {
+                break;
+            }
+            if (static_cast<unsigned char>(*q) >= 0x80) {
+                std::size_t len = debug_utf8_length(q, end);
+                if (len) {
+                    os.write(q, static_cast<std::streamsize>(len));
+                    p = q + len;
+                } else {
+                    os << "\\ufffd";
+                    p = q + 1;
+                }
+                continue;
+            }
+            switch (*q) {
+            case '"': os << "\\\""; break;
+            case '\\': os << "\\\\"; break;
+            case '\n': os << "\\n"; break;
+            case '\r': os << "\\r"; break;
+            case '\t': os << "\\t"; break;
+            default: {
+                auto u = static_cast<unsigned char>(*q);
+                char esc[6] = {'\\', 'u', '0', '0', hex[u >> 4], hex[u & 15]};
+                os.write(esc, sizeof(esc));
+            } break;
+            }
+            p = q + 1;
+        }
+        os << '"';
+    }
+
+    static void debug_json_quote(std::ostream &os, char const *s) {
+        debug_json_quote(os, s, std::char_traits<char>::length(s));
+    }
+
+    // what DEBUG_REPR writes to formatter.os, turned into a JSON object:
+    // the braces, the commas, and each name with DEBUG_NAMED_MEMBER_MARK
+    struct debug_json_repr_os {
+        std::ostream &os;
+        bool open;
+
+        explicit debug_json_repr_os(std::ostream &os) : os(os), open(false) {}
+
+        debug_json_repr_os &operator<<(char) {
+            os << (open ? '}' : '{');
+            open = true;
+            return *this;
+        }
+
+        debug_json_repr_os &operator<<(char const *s) {
+            std::size_t n = std::char_traits<char>::length(s);
+            if (!std::strcmp(s, DEBUG_TUPLE_COMMA)) {
+                os << ',';
+                return *this;
             }
+            std::size_t mark =
+                std::char_traits<char>::length(DEBUG_NAMED_MEMBER_MARK);
+            debug_json_quote(os, s, n >= mark ? n - mark : n);
+            os << ':';
+            return *this;
         }
-# if DEBUG_SHOW_LOCATION
-        oss << fn << DEBUG_SEPARATOR_FILE << loc.line() << DEBUG_SEPARATOR_LINE
-            << DEBUG_SEPARATOR_TAB;
+    };
+
+    struct debug_json_formatter {
+        debug_json_repr_os os;
+
+        explicit debug_json_formatter(std::ostream &os) : os(os) {}
+
+        template <class T>
+        debug_json_formatter &operator<<(T const &value) {
+            debug_json_encode(os.os, value);
+            return *this;
+        }
+
+        bool full(char const *, char const *) const {
+            return false;
+        }
+    };
+
+    DEBUG_COND(is_member_repr_json,
+               std::declval<T const &>().DEBUG_FORMATTER_REPR_NAME(
+                   std::declval<debug_json_formatter const &>()));
+    DEBUG_COND(is_adl_repr_json,
+               DEBUG_FORMATTER_REPR_NAME(
+                   std::declval<debug_json_formatter const &>(),
+                   std::declval<T const &>()));
+
+    enum debug_json_kind {
+        debug_json_text,
+        debug_json_bool,
+        debug_json_null,
+        debug_json_char,
+        debug_json_signed,
+        debug_json_unsigned,
+        debug_json_float,
+        debug_json_string,
+        debug_json_smart_pointer,
+        debug_json_wrapper,
+        debug_json_pointer,
+        debug_json_array,
+        debug_json_tuple,
+        debug_json_member_repr,
+        debug_json_adl_repr,
+        debug_json_member_repr_debug,
+        debug_json_adl_repr_debug,
+        debug_json_variant,
+        debug_json_optional,
+    };
+
+    // how a value is encoded, in the order of debug_format_trait (except
+    // that null pointers are null), wide characters, enums and types with an
+    // operator<< keep their text form
+    template <class T>
+    struct debug_json_kind_of
+        : std::integral_constant<
+              debug_json_kind,
+              std::is_same<T, bool>::value ? debug_json_bool
+              : std::is_same<T, std::nullptr_t>::value ? debug_json_null
+              : std::is_same<T, char>::value           ? debug_json_char
+              : std::is_same<T, wchar_t>::value ||
+                      std::is_same<T, char16_t>::value ||
+                      std::is_same<T, char32_t>::value
+                  ? debug_json_text
+              : std::is_integral<T>::value
+                  ? (std::is_signed<T>::value ? debug_json_signed
+                                              : debug_json_unsigned)
+              : std::is_floating_point<T>::value ? debug_json_float
+              : std::is_convertible<T const &, DEBUG_STRING_VIEW>::value
+                  ? debug_json_string
+              : debug_cond_is_smart_pointer<T>::value
+                  ? debug_json_smart_pointer
+              : debug_cond_error_code<T>::value ? debug_json_text
+              : debug_cond_reference_wrapper<T>::value ? debug_json_wrapper
+              : debug_cond_pointer<T>::value           ? debug_json_pointer
+              : debug_cond_is_ostream_ok<T>::value     ? debug_json_text
+              : debug_cond_is_range<T>::value          ? debug_json_array
+              : debug_cond_is_tuple<T>::value          ? debug_json_tuple
+              : debug_cond_enum<T>::value              ? debug_json_text
+              : debug_cond_is_member_repr<T>::value ? debug_json_member_repr
+              : debug_cond_is_member_repr_stream<T>::value ? debug_json_text
+              : debug_cond_is_adl_repr<T>::value ? debug_json_adl_repr
+              : debug_cond_is_adl_repr_stream<T>::value ? debug_json_text
+              : debug_cond_is_member_repr_json<T>::value
+                  ? debug_json_member_repr_debug
+              : debug_cond_is_adl_repr_json<T>::value
+                  ? debug_json_adl_repr_debug
+              : debug_cond_is_variant<T>::value ? debug_json_variant
+              : debug_cond_is_optional<T>::value        ? debug_json_optional
+                                                        : debug_json_text> {};
+
+    template <class T>
+    static void debug_json_encode(std::ostream &os, T const &t) {
+        debug_json_value(os, t, debug_json_kind_of<T>());
+    }
+
+    template <class T>
+    static void debug_json_value(std::ostream &os, T const &t,
+                                 std::integral_constant<debug_json_kind,
+                                                        debug_json_text>) {
+        debug_line_stream_lease text;
+        text.stream.iword(debug_range_limit_index()) =
+            os.iword(debug_range_limit_index());
+        debug_format(text.stream, t);
+        debug_json_quote(os, text.stream.data(), text.stream.size());
+    }
+
+    template <class T>
+    static void debug_json_value(std::ostream &os, T const &t,
+                                 std::integral_constant<debug_json_kind,
+                                                        debug_json_bool>) {
+        os << (t ? "true" : "false");
+    }
+
+    template <class T>
+    static void debug_json_value(std::ostream &os, T const &,
+                                 std::integral_constant<debug_json_kind,
+                                                        debug_json_null>) {
+        os << "null";
+    }
+
+    template <class T>
+    static void debug_json_value(std::ostream &os, T const &t,
+                                 std::integral_constant<debug_json_kind,
+                                                        debug_json_char>) {
+        debug_json_quote(os, &t, 1);
+    }
+
+    template <class T>
+    static void debug_json_value(std::ostream &os, T const &t,
+                                 std::integral_constant<debug_json_kind,
+                                                        debug_json_signed>) {
+        os << static_cast<std::intmax_t>(t);
+    }
+
+    template <class T>
+    static void debug_json_value(std::ostream &os, T const &t,
+                                 std::integral_constant<debug_json_kind,
+                                                        debug_json_unsigned>) {
+        os << static_cast<std::uintmax_t>(t);
+    }
+
+    template <class T>
+    static void debug_json_value(std::ostream &os, T const &t,
+                                 std::integral_constant<debug_json_kind,
+                                                        debug_json_float>) {
+        if (t != t || t - t != 0) {
+            os << "null";
+            return;
+        }
+        auto flags = os.flags();
+        auto precision = os.precision();
+        os.flags(std::ios_base::dec);
+        os.precision(std::numeric_limits<T>::max_digits10);
+        os << t;
+        os.precision(precision);
+        os.flags(flags);
+    }
+
+    static void debug_json_string_value(std::ostream &os,
+                                        DEBUG_STRING_VIEW sv) {
+        debug_json_quote(os, sv.data(), sv.size());
+    }
+
+    static void debug_json_string_value(std::ostream &os, char const *s) {
+        if (s) {
+            debug_json_quote(os, s);
+        } else {
+            os << "null";
+        }
+    }
+
+    template <class T>
+    static void debug_json_value(std::ostream &os, T const &t,
+                                 std::integral_constant<debug_json_kind,
+                                                        debug_json_string>) {
+        debug_json_string_value(os, t);
+    }
+
+    // an object printed before in the line is referred to as in its text
+    // (where the anchor of its first print is in the message)
+    template <class T>
+    static void debug_json_pointee(std::ostream &os, T const &t) {
+        if (debug_line_stream *line = debug_line_stream_of(os)) {
+            if (debug_ref_table::slot *s =
+                    line->refs.visit(std::addressof(t), typeid(T), 0)) {
+                os << "\"<ref #" << s->id << ">\"";
+                return;
+            }
+        }
+        debug_json_encode(os, t);
+    }
+
+    template <class T>
+    static void debug_json_value(std::ostream &os, T const &t,
+                                 std::integral_constant<
+                                     debug_json_kind,
+                                     debug_json_smart_pointer>) {
+        if (t.get() == nullptr) {
+            os << "null";
+            return;
+        }
+# if DEBUG_SMART_POINTER_MODE == 2
+        debug_json_value(
+            os, t,
+            std::integral_constant<debug_json_kind, debug_json_text>());
+# else
+        debug_json_pointee(os, *t.get());
 # endif
-# if DEBUG_SHOW_SOURCE_CODE_LINE
-        {
-            static thread_local std::unordered_map<std::string, std::string>
-                fileCache;
-            auto key = std::to_string(loc.line()) + loc.file_name();
-            if (auto it = fileCache.find(key);
-                it != fileCache.end() && !it->second.empty()) {
-                DEBUG_LIKELY {
-                    oss << DEBUG_SOURCE_LINE_BRACE[0] << it->second
-                        << DEBUG_SOURCE_LINE_BRACE[1];
-                }
-            } else if (auto file = std::ifstream(loc.file_name());
-                       file.is_open()) {
-                DEBUG_LIKELY {
-                    std::string line;
-                    for (std::uint32_t i = 0; i < loc.line(); ++i) {
-                        if (!std::getline(file, line)) {
-                            DEBUG_UNLIKELY {
-                                line.clear();
-                                break;
-                            }
-                        }
-                    }
-                    if (auto pos = line.find_first_not_of(" \t\r\n");
-                        pos != line.npos) {
-                        DEBUG_LIKELY {
-                            line = line.substr(pos);
-                        }
-                    }
-                    if (!line.empty()) {
-                        DEBUG_LIKELY {
-                            if (line.back() == ';') {
-                                DEBUG_LIKELY {
-                                    line.pop_back();
-                                }
-                            }
-                            oss << DEBUG_SOURCE_LINE_BRACE[0] << line
-                                << DEBUG_SOURCE_LINE_BRACE[1];
-                        }
+    }
+
+    template <class T>
+    static void debug_json_value(std::ostream &os, T const &t,
+                                 std::integral_constant<debug_json_kind,
+                                                        debug_json_wrapper>) {
+        debug_json_encode(os, t.get());
+    }
+
+    template <class T>
+    static void debug_json_value(std::ostream &os, T const &t,
+                                 std::integral_constant<debug_json_kind,
+                                                        debug_json_pointer>) {
+        if (t == nullptr) {
+            os << "null";
+            return;
+        }
+        debug_json_value(
+            os, t, std::integral_constant<debug_json_kind, debug_json_text>());
+    }
+
+    // the same elements as the text shows, with an {"elided":n} object in
+    // place of the "... (n more) ..." there
+    template <class It, class Ite>
+    static void debug_json_elided(std::ostream &os, It b, Ite e,
+                                  std::input_iterator_tag) {
+        std::size_t limit = debug_range_limit(os);
+        for (std::size_t i = 0; b != e; ++b, ++i) {
+            if (i) {
+                os << ',';
+            }
+            if (i == limit && limit) {
+                DEBUG_UNLIKELY {
+                    std::size_t more = 0;
+                    for (; b != e; ++b) {
+                        ++more;
                     }
-                    fileCache.try_emplace(key, std::move(line));
+                    os << "{\"elided\":" << more << '}';
+                    return;
                 }
-            } else {
-                oss << DEBUG_SOURCE_LINE_BRACE[0] << '?'
-                    << DEBUG_SOURCE_LINE_BRACE[1];
-                fileCache.try_emplace(key);
             }
+            debug_json_encode(os, *b);
         }
-# endif
-        oss << ' ';
+    }
+
+    template <class It>
+    static void debug_json_elided(std::ostream &os, It b, It e,
+                                  std::forward_iterator_tag) {
+        std::size_t limit = debug_range_limit(os);
+        std::size_t n = limit ? static_cast<std::size_t>(std::distance(b, e))
+                              : 0;
+        if (n <= limit) {
+            DEBUG_LIKELY {
+                debug_json_elided(os, b, e, std::input_iterator_tag());
+                return;
+            }
+        }
+        std::size_t head = (limit + 1) / 2;
+        std::size_t tail = limit / 2;
+        for (std::size_t i = 0; i < head; ++i, ++b) {
+            debug_json_encode(os, *b);
+            os << ',';
+        }
+        os << "{\"elided\":" << n - head - tail << '}';
+        std::advance(b, static_cast<typename std::iterator_traits<
+                                It>::difference_type>(n - head - tail));
+        for (; b != e; ++b) {
+            os << ',';
+            debug_json_encode(os, *b);
+        }
+    }
+
+    template <class T>
+    static void debug_json_value(std::ostream &os, T const &t,
+                                 std::integral_constant<debug_json_kind,
+                                                        debug_json_array>) {
+        using It = decltype(std::begin(t));
+        using Ite = decltype(std::end(t));
+        using category = typename std::conditional<
+            std::is_same<It, Ite>::value,
+            typename debug_iterator_category<It>::type,
+            std::input_iterator_tag>::type;
+        os << '[';
+        debug_json_elided(os, std::begin(t), std::end(t), category());
+        os << ']';
+    }
+
+    struct debug_json_apply_lambda {
+        std::ostream &os;
+
+        template <class... Args>
+        void operator()(Args const &...args) const {
+            bool first = true;
+            int unused[] = {0, (os << (first ? "" : ","), first = false,
+                                debug_json_encode(os, args), 0)...};
+            (void)unused;
+        }
+    };
+
+    template <class T>
+    static void debug_json_value(std::ostream &os, T const &t,
+                                 std::integral_constant<debug_json_kind,
+                                                        debug_json_tuple>) {
+        os << '[';
+        debug_apply(debug_json_apply_lambda{os}, t);
+        os << ']';
+    }
+
+    template <class T>
+    static void debug_json_value(std::ostream &os, T const &t,
+                                 std::integral_constant<
+                                     debug_json_kind, debug_json_member_repr>) {
+        debug_json_encode(os, t.DEBUG_REPR_NAME());
+    }
+
+    template <class T>
+    static void debug_json_value(std::ostream &os, T const &t,
+                                 std::integral_constant<debug_json_kind,
+                                                        debug_json_adl_repr>) {
+        debug_json_encode(os, DEBUG_REPR_NAME(t));
+    }
+
+    template <class T>
+    static void debug_json_value(std::ostream &os, T const &t,
+                                 std::integral_constant<
+                                     debug_json_kind,
+                                     debug_json_member_repr_debug>) {
+        t.DEBUG_FORMATTER_REPR_NAME(debug_json_formatter(os));
+    }
+
+    template <class T>
+    static void debug_json_value(std::ostream &os, T const &t,
+                                 std::integral_constant<
+                                     debug_json_kind,
+                                     debug_json_adl_repr_debug>) {
+        DEBUG_FORMATTER_REPR_NAME(debug_json_formatter(os), t);
+    }
+
+    struct debug_json_visit_lambda {
+        std::ostream &os;
+
+        template <class T>
+        void operator()(T const &t) const {
+            debug_json_encode(os, t);
+        }
+    };
+
+    template <class T>
+    static void debug_json_value(std::ostream &os, T const &t,
+                                 std::integral_constant<debug_json_kind,
+                                                        debug_json_variant>) {
+        visit(debug_json_visit_lambda{os}, t);
+    }
+
+    template <class T>
+    static void debug_json_value(std::ostream &os, T const &t,
+                                 std::integral_constant<debug_json_kind,
+                                                        debug_json_optional>) {
+        if ((bool)t) {
+            debug_json_encode(os, debug_deref_avoid(t));
+        } else {
+            os << "null";
+        }
+    }
+
+    // the fields before the arguments, the message is appended at the end
+    debug &debug_json_begin(bool location) {
+        json << '{';
+#  if DEBUG_SHOW_TIMESTAMP
+        json << "\"timestamp\":" << debug_timestamp_now() << ',';
+#  endif
+#  if DEBUG_SHOW_THREAD_ID
+        debug_thread_label const &label =
+            debug_thread_label_of(debug_thread_now());
+        json << "\"thread\":";
+        debug_json_quote(json, label.text + 1, label.size - 3);
+        json << ',';
+#  endif
+        if (location) {
+            json << "\"file\":";
+            debug_json_quote(json, loc.file_name());
+            json << ",\"line\":" << loc.line() << ",\"function\":";
+            debug_json_quote(json, loc.function_name());
+            json << ',';
+        }
+        json << "\"args\":[";
+        return *this;
+    }
+
+    // t has just been formatted into oss as [text, text + n)
+    template <class T>
+    void debug_json_arg(T const &t, char const *text, std::size_t n) {
+        if (json.data()[json.size() - 1] != '[') {
+            json << ',';
+        }
+        if (debug_json_kind_of<T>::value == debug_json_text) {
+            debug_json_quote(json, text, n);
+        } else {
+            json.iword(debug_range_limit_index()) =
+                oss.iword(debug_range_limit_index());
+            debug_json_encode(json, t);
+        }
+    }
+
+    // completes the line with its '\n', and returns the stream holding it
+    debug_line_stream &debug_finish_line() {
+        json << "],\"message\":";
+        debug_json_quote(json, oss.data(), oss.size());
+        json << "}\n";
+        return json;
+    }
+
+    debug &add_location_marks() {
+        return debug_json_begin(true);
+    }
+# else
+    debug &add_location_marks() {
+        auto line = static_cast<std::uint32_t>(loc.line());
+        // the site looked up before a setloc() is not this line's site
+        bool known = call_site && call_site->file == loc.file_name() &&
+                     call_site->line == line &&
+                     call_site->column ==
+                         static_cast<std::uint32_t>(loc.column());
+#  if DEBUG_CALL_SITE_CONTROL || DEBUG_ENABLE_FILES_MATCH || DEBUG_COALESCE
+        // these keep every printed site anyway
+        if (!known) {
+            call_site = &debug_call_site_of(loc);
+            known = true;
+        }
+#  endif
+        debug_format_marks(oss, known ? &call_site->prefix : nullptr,
+                           loc.file_name(), line, debug_timestamp_now(),
+                           debug_thread_now());
         return *this;
     }
 
+    // completes the line with its '\n', and returns the stream holding it
+    debug_line_stream &debug_finish_line() {
+        oss << '\n';
+        return oss;
+    }
+# endif
+
     template <class T>
     struct DEBUG_NODISCARD debug_condition {
     private:
@@ -1479,6 +5765,22 @@ private:
     };
 
     debug &on_error(char const *msg) {
+# if DEBUG_DEFERRED
+        debug_deferred_undefer();
+# endif
+# if DEBUG_LINE_CHUNKS
+        // the failure goes on a line of its own after a streamed one
+        oss.buf.streaming = false;
+        if (oss.buf.streamed) {
+            DEBUG_UNLIKELY {
+                oss << '\n';
+                oss.buf.streamed = false;
+                debug_stream_end(oss.data(), oss.size());
+                oss.buf.reset();
+                state = silent;
+            }
+        }
+# endif
         if (state != supress) {
             state = panic;
             add_location_marks();
@@ -1494,46 +5796,79 @@ private:
         if (state == supress) {
             return *this;
         }
+# if DEBUG_DEFERRED
+        if (state == silent || deferred) {
+            if (state == silent) {
+                state = print;
+                debug_deferred_begin();
+            } else if (oss.truncated) {
+                // an argument formatted right away ran out of max_bytes
+                DEBUG_UNLIKELY {
+                    return *this;
+                }
+            }
+#  if DEBUG_COALESCE
+            std::size_t start = oss.size();
+            debug_deferred_capture(t, debug_deferred_kind<T>());
+            hash = debug_hash_bytes(hash, oss.data() + start,
+                                    oss.size() - start);
+#  else
+            debug_deferred_capture(t, debug_deferred_kind<T>());
+#  endif
+            return *this;
+        }
+# endif
         if (state == silent) {
             state = print;
             add_location_marks();
+        } else if (debug_bytes_left(oss, 1) == 0) {
+            DEBUG_UNLIKELY {
+                return *this;
+            }
         } else {
             oss << ' ';
         }
+# if DEBUG_JSON || DEBUG_COALESCE
+        std::size_t start = oss.size();
+        debug_format(oss, t);
+#  if DEBUG_JSON
+        debug_json_arg(t, oss.data() + start, oss.size() - start);
+#  endif
+#  if DEBUG_COALESCE
+        hash = debug_hash_bytes(hash, oss.data() + start, oss.size() - start);
+#  endif
+# else
         debug_format(oss, t);
+# endif
         return *this;
     }
-# if DEBUG_ENABLE_FILES_MATCH
-    static bool file_detected(char const *file) noexcept {
-        static auto files = std::getenv("DEBUG_FILES");
-        if (!files) {
-            return true;
-        }
-        DEBUG_STRING_VIEW sv = files;
-        /* std::size_t pos = 0, nextpos; */
-        /* while ((nextpos = sv.find(' ')) != sv.npos) { */
-        /*     if (sv.substr(pos, nextpos - pos) == tag) { */
-        /*         return true; */
-        /*     } */
-        /*     pos = nextpos + 1; */
-        /* } */
-        if (sv.find(file) != sv.npos) {
-            return true;
-        }
-        return false;
-    }
-# endif
 public:
     explicit debug(bool enable = true,
                    DEBUG_SOURCE_LOCATION const &loc =
                        DEBUG_SOURCE_LOCATION::current()) noexcept
-        : state(enable
-# if DEBUG_ENABLE_FILES_MATCH
-                        && file_detected(loc.file_name())
+        : oss(oss_lease.stream),
+# if DEBUG_JSON
+          json(json_lease.stream),
 # endif
-                    ? silent
-                    : supress),
+          state(enable ? silent : supress),
           loc(loc) {
+# if DEBUG_LINE_CHUNKS
+        oss.buf.streaming = true;
+# endif
+# if DEBUG_CALL_SITE_CONTROL || DEBUG_ENABLE_FILES_MATCH
+        // the DEBUG_FILES match and the runtime rules are cached per site
+        if (state == silent) {
+            call_site = debug_call_site_find(loc);
+            if (call_site &&
+                call_site->enabled.load(std::memory_order_relaxed) != 1) {
+                DEBUG_UNLIKELY {
+                    if (!debug_call_site_refresh(*call_site)) {
+                        state = supress;
+                    }
+                }
+            }
+        }
+# endif
     }
 
     debug &setloc(DEBUG_SOURCE_LOCATION const &newloc =
@@ -1545,6 +5880,97 @@ public:
     debug &noloc() noexcept {
         if (state == silent) {
             state = print;
+# if DEBUG_JSON
+            debug_json_begin(false);
+# endif
+        }
+        return *this;
+    }
+
+    // element budget for ranges printed in this line, 0 means no limit
+    debug &limit(std::size_t n) {
+        // a budget past what the iword holds is no limit either
+        if (n >= static_cast<std::size_t>(std::numeric_limits<long>::max())) {
+            n = 0;
+        }
+        oss.iword(debug_range_limit_index()) = static_cast<long>(n) + 1;
+        return *this;
+    }
+
+    // byte budget for this line, 0 means no limit
+    debug &max_bytes(std::size_t n) noexcept {
+        oss.max_bytes = n;
+        return *this;
+    }
+
+private:
+    // counts this call at its call site (once, however many throttles are
+    // chained), returns how many calls the site had before it, a site is a
+    // file, line and column, and the column is 0 before C++20, so there
+    // throttled calls on one line share their counters
+    std::uint64_t debug_sample() {
+        if (!sampled) {
+            sampled = true;
+            if (!call_site) {
+                call_site = &debug_call_site_of(loc);
+            }
+            call_index =
+                call_site->calls.fetch_add(1, std::memory_order_relaxed);
+        }
+        return call_index;
+    }
+
+public:
+    // only print every n-th call from this call site
+    debug &every(std::uint64_t n) {
+        if (state != supress) {
+            if (n && debug_sample() % n != 0) {
+                state = supress;
+            }
+        }
+        return *this;
+    }
+
+    // only print the first n calls from this call site
+    debug &first(std::uint64_t n) {
+        if (state != supress) {
+            if (debug_sample() >= n) {
+                state = supress;
+            }
+        }
+        return *this;
+    }
+
+    // print at most n calls per second from this call site
+    debug &rate_per_sec(std::uint64_t n) {
+        if (state != supress) {
+            debug_sample();
+            debug_call_site &site = *call_site;
+            std::uint64_t now = static_cast<std::uint32_t>(
+                std::chrono::duration_cast<std::chrono::seconds>(
+                    std::chrono::steady_clock::now().time_since_epoch())
+                    .count() +
+                1);
+            // the count has 32 bits
+            std::uint64_t const limit = n < 0xffffffff ? n : 0xffffffff;
+            std::uint64_t old = site.rate.load(std::memory_order_relaxed);
+            for (;;) {
+                // another thread may have read the clock after this one
+                if (old >> 32 > now) {
+                    now = old >> 32;
+                }
+                std::uint64_t count = old >> 32 == now ? old & 0xffffffff : 0;
+                if (count >= limit) {
+                    // the second is used up, nothing to count
+                    state = supress;
+                    break;
+                }
+                if (site.rate.compare_exchange_weak(
+                        old, now << 32 | (count + 1),
+                        std::memory_order_relaxed)) {
+                    break;
+                }
+            }
         }
         return *this;
     }
@@ -1582,6 +6008,16 @@ public:
         return *this;
     }
 
+    // calls f(*this) only if this line is going to be output, so that the
+    // arguments f prints are not even evaluated otherwise, see DEBUG_LAZY
+    template <class F>
+    debug &lazy(F &&f) {
+        if (state != supress) {
+            f(*this);
+        }
+        return *this;
+    }
+
     template <class T>
     debug &operator<<(T const &t) {
         return on_print(t);
@@ -1596,14 +6032,32 @@ public:
 # if DEBUG_PANIC_METHOD == 0
         noexcept(false)
 # endif
-    {
+    {
+        if (sampled && state != supress) {
+            call_site->printed.fetch_add(1, std::memory_order_relaxed);
+        }
+# if DEBUG_LINE_CHUNKS
+        if (oss.buf.streamed) {
+            DEBUG_UNLIKELY {
+                oss << '\n';
+                state = supress;
+                debug_stream_end(oss.data(), oss.size());
+            }
+        }
+# endif
         if (state == panic) {
             DEBUG_UNLIKELY {
+# if DEBUG_FLIGHT_RECORDER
+                dump_flight_recorder();
+# endif
 # if DEBUG_PANIC_METHOD == 0
+                flush();
                 throw std::runtime_error(oss.str());
 # elif DEBUG_PANIC_METHOD == 1
-                oss << '\n';
-                DEBUG_OUTPUT(oss.str());
+                debug_line_stream &line = debug_finish_line();
+                flush();
+                debug_output(line.data(), line.size());
+                debug_sink_flush();
 #  if defined(DEBUG_PANIC_CUSTOM_TRAP)
                 DEBUG_PANIC_CUSTOM_TRAP;
                 return;
@@ -1621,20 +6075,41 @@ public:
                 std::terminate();
 #  endif
 # elif DEBUG_PANIC_METHOD == 2
-                oss << '\n';
-                DEBUG_OUTPUT(oss.str());
+                debug_line_stream &line = debug_finish_line();
+                flush();
+                debug_output(line.data(), line.size());
+                debug_sink_flush();
                 std::terminate();
 # else
-                oss << '\n';
-                DEBUG_OUTPUT(oss.str());
+                debug_line_stream &line = debug_finish_line();
+                flush();
+                debug_output(line.data(), line.size());
+                debug_sink_flush();
                 return;
 # endif
             }
         }
+# if DEBUG_COALESCE
+        if (state == print && !debug_coalesce()) {
+            state = supress;
+        }
+# endif
         if (state == print) {
-            oss << '\n';
-            DEBUG_OUTPUT(oss.str());
+# if DEBUG_DEFERRED
+            if (deferred) {
+                debug_emit(oss.data(), oss.size());
+            } else {
+                oss << '\n';
+                debug_emit(oss.data(), oss.size());
+            }
+# else
+            debug_line_stream &line = debug_finish_line();
+            debug_emit(line.data(), line.size());
+# endif
         }
+# if DEBUG_STEPPING
+        flush();
+# endif
 # if DEBUG_STEPPING == 1
         static std::mutex mutex;
         std::lock_guard lock(mutex);
@@ -1683,6 +6158,24 @@ public:
     }
 
     operator std::string() {
+# if DEBUG_DEFERRED
+        debug_deferred_undefer();
+# endif
+# if DEBUG_LINE_CHUNKS
+        // most of the line is gone to the output already, there is no
+        // string to return
+        if (oss.buf.streamed) {
+            DEBUG_UNLIKELY {
+                oss << '\n';
+                state = supress;
+                oss.buf.streamed = false;
+                debug_stream_end(oss.data(), oss.size());
+                throw std::length_error(
+                    "debug: a line converted to std::string was too long, "
+                    "and was output in chunks instead");
+            }
+        }
+# endif
         std::string ret = oss.str();
         state = supress;
         return ret;
@@ -1737,10 +6230,15 @@ public:
     template <class T>
     static typename std::enable_if<std::is_integral<T>::value>::type
     _hexdump_print_hex(std::ostream &os, T const &value) {
-        os << std::hex << std::setfill('0') << std::uppercase
-           << std::setw(sizeof(T) * 2);
-        os << static_cast<std::uintmax_t>(
+        // written straight from a table, not through the stream's flags
+        static char const hex[] = "0123456789ABCDEF";
+        auto u = static_cast<std::uintmax_t>(
             static_cast<typename std::make_unsigned<T>::type>(value));
+        char buf[sizeof(T) * 2];
+        for (std::size_t i = sizeof(buf); i != 0; u >>= 4) {
+            buf[--i] = hex[u & 15];
+        }
+        os.write(buf, sizeof(buf));
     }
 
     template <class T>
@@ -1749,21 +6247,21 @@ public:
         debug_format(os, value);
     }
 
+    struct _hexdump_each {
+        template <class U>
+        void operator()(std::ostream &os, U const &value) const {
+            _hexdump_print_hex(os, value);
+        }
+    };
+
     template <class It, class Ite>
     struct hexdump_t {
         It first;
         Ite last;
 
         void DEBUG_REPR_NAME(std::ostream &os) const {
-            bool previous = false;
             auto f = os.flags();
-            for (It it = first; it != last; ++it) {
-                if (previous) {
-                    os << ' ';
-                }
-                _hexdump_print_hex(os, *it);
-                previous = true;
-            }
+            debug_range_elided(os, first, last, " ", _hexdump_each());
             os.flags(f);
         }
     };
@@ -1799,7 +6297,219 @@ public:
     hexdump(T const &value) {
         return _hexdump_impl(value, 0, 0);
     }
+
+    // the bytes of [data, data + size) as rows of `xxd`:
+    // "00000010: 6865 6c6c 6f0a 0000 0000 0000 0000 0000  hello..........."
+    // a run of rows equal to the row above is collapsed into one "*" row,
+    // and the rows are rendered into a small buffer, each full buffer goes
+    // straight to the output (unless the line is kept whole, lines of other
+    // threads may come in between without DEBUG_STREAM_THRESHOLD), the
+    // budget of debug().limit(n) counts bytes
+    struct xxd_t {
+        unsigned char const *data;
+        std::size_t size;
+
+        // "00" to "ff", so that each byte is one 2-byte copy
+        static char const *_hex_pairs() noexcept {
+            static struct table {
+                char pairs[512];
+
+                table() noexcept {
+                    static char const hex[] =
+# if DEBUG_HEXADECIMAL_UPPERCASE
+                        "0123456789ABCDEF";
+# else
+                        "0123456789abcdef";
+# endif
+                    for (int i = 0; i < 256; ++i) {
+                        pairs[i * 2] = hex[i >> 4];
+                        pairs[i * 2 + 1] = hex[i & 15];
+                    }
+                }
+            } const t;
+            return t.pairs;
+        }
+
+        struct _writer {
+            std::ostream &os;
+            int digits;
+            std::size_t used = 0;
+            // the line ran out of bytes, nothing more is written
+            bool full = false;
+            char buf[4096];
+
+            _writer(std::ostream &os, int digits) noexcept
+                : os(os), digits(digits) {}
+
+            void flush() {
+                if (full) {
+                    used = 0;
+                    return;
+                }
+                os.write(buf, static_cast<std::streamsize>(used));
+                used = 0;
+                full = debug_bytes_left(os) == 0;
+            }
+
+            // a dump that does not fit in buf is not built up in the line
+            void flush_out() {
+                flush();
+# if DEBUG_LINE_CHUNKS
+                if (debug_line_stream *line = debug_line_stream_of(os)) {
+                    line->buf.chunk_out();
+                }
+# endif
+            }
+
+            // whether n more bytes fit in the line, the first row that does
+            // not ends the dump, after the rows before it are written
+            bool fits(std::size_t n) {
+                if (full) {
+                    return false;
+                }
+                debug_line_stream *line = debug_line_stream_of(os);
+                if (!line || !line->max_bytes ||
+                    line->buf.written() + used + n < line->max_bytes) {
+                    DEBUG_LIKELY {
+                        return true;
+                    }
+                }
+                flush();
+                if (!full) {
+                    debug_bytes_left(os, n);
+                    full = true;
+                }
+                return false;
+            }
+
+            char *reserve(std::size_t n) {
+                if (sizeof(buf) - used < n) {
+                    flush_out();
+                }
+                char *p = buf + used;
+                used += n;
+                return p;
+            }
+
+            void row(unsigned char const *data, std::size_t offset,
+                     std::size_t n) {
+                if (!fits(static_cast<std::size_t>(digits) + 44 + n)) {
+                    return;
+                }
+                char const *pairs = _hex_pairs();
+                char *p = reserve(static_cast<std::size_t>(digits) + 60);
+                *p++ = '\n';
+                for (int i = digits; i-- != 0;) {
+                    p[i] = pairs[(offset & 15) * 2 + 1];
+                    offset >>= 4;
+                }
+                p += digits;
+                *p++ = ':';
+                for (std::size_t i = 0; i < 16; ++i) {
+                    if (i % 2 == 0) {
+                        *p++ = ' ';
+                    }
+                    if (i < n) {
+                        std::memcpy(p, pairs + data[i] * 2, 2);
+                    } else {
+                        p[0] = p[1] = ' ';
+                    }
+                    p += 2;
+                }
+                *p++ = ' ';
+                *p++ = ' ';
+                for (std::size_t i = 0; i < n; ++i) {
+                    *p++ = data[i] >= 0x20 && data[i] < 0x7f
+                               ? static_cast<char>(data[i])
+                               : '.';
+                }
+                used = static_cast<std::size_t>(p - buf);
+            }
+
+            void text(char const *s, std::size_t n) {
+                if (!fits(n)) {
+                    return;
+                }
+                std::memcpy(reserve(n), s, n);
+            }
+
+            // [begin, end) of the whole data, in rows of 16 from begin
+            void rows(unsigned char const *data, std::size_t begin,
+                      std::size_t end) {
+                bool starred = false;
+                for (std::size_t at = begin; at < end && !full; at += 16) {
+                    std::size_t n = end - at < 16 ? end - at : 16;
+                    if (at != begin && n == 16 && at + 16 < end &&
+                        std::memcmp(data + at, data + at - 16, 16) == 0) {
+                        if (!starred) {
+                            starred = true;
+                            text("\n*", 2);
+                        }
+                        continue;
+                    }
+                    starred = false;
+                    row(data + at, at, n);
+                }
+            }
+        };
+
+        void DEBUG_REPR_NAME(std::ostream &os) const {
+            std::uint64_t last = size ? size - 1 : 0;
+            int digits = 8;
+            while (digits < 16 && last >> (digits * 4) != 0) {
+                ++digits;
+            }
+            _writer w(os, digits);
+            std::size_t limit = debug_range_limit(os);
+            if (!limit || size <= limit) {
+                DEBUG_LIKELY {
+                    w.rows(data, 0, size);
+                    w.flush();
+                    return;
+                }
+            }
+            // the first and last half of the budget
+            std::size_t head = (limit + 1) / 2;
+            std::size_t tail = size - limit / 2;
+            w.rows(data, 0, head);
+            w.text("\n", 1);
+            w.flush();
+            if (w.full) {
+                return;
+            }
+            debug_range_elision(os, tail - head);
+            w.rows(data, tail, size);
+            w.flush();
+        }
+    };
+
+    static xxd_t xxd(void const *data, std::size_t size) noexcept {
+        return {static_cast<unsigned char const *>(data), size};
+    }
+
+    template <class T>
+    static auto _xxd_impl(T const &value, int) noexcept
+        -> decltype(xxd(value.data(), value.size())) {
+        return xxd(value.data(), value.size() * sizeof(*value.data()));
+    }
+
+    template <class T>
+    static xxd_t _xxd_impl(T const &value, short) noexcept {
+        return xxd(std::addressof(value), sizeof(T));
+    }
+
+    // the elements of a contiguous container (anything with .data() and
+    // .size()), or else the object representation of value itself
+    template <class T>
+    static xxd_t xxd(T const &value) noexcept {
+        return _xxd_impl(value, 0);
+    }
 };
+// DEBUG_LAZY(debug().every(100), "x:", expensive(x)) evaluates the arguments
+// only when the line is output, and not at all in release builds
+# define DEBUG_LAZY(d, ...) \
+    (d).lazy([&](typename std::remove_reference<decltype(d)>::type & \
+                 debug_lazy_line) { debug_lazy_line, __VA_ARGS__; })
 # if defined(_MSC_VER) && (!defined(_MSVC_TRADITIONAL) || _MSVC_TRADITIONAL)
 #  define DEBUG_REPR(...) \
       __pragma( \
@@ -1924,12 +6634,15 @@ public:
 #  define DEBUG_PP_UNWRAP_BRACE(...)  DEBUG_PP_UNWRAP_BRACE_ __VA_ARGS__
 #  define DEBUG_PP_UNWRAP_BRACE_(...) __VA_ARGS__
 #  define DEBUG_REPR_ON_EACH(x) \
-      if (add_comma) \
-          formatter.os << DEBUG_TUPLE_COMMA; \
-      else \
-          add_comma = true; \
-      formatter.os << #x DEBUG_NAMED_MEMBER_MARK; \
-      formatter << x;
+      if (!formatter.full(add_comma ? DEBUG_TUPLE_COMMA : "", \
+                          #x DEBUG_NAMED_MEMBER_MARK)) { \
+          if (add_comma) \
+              formatter.os << DEBUG_TUPLE_COMMA; \
+          else \
+              add_comma = true; \
+          formatter.os << #x DEBUG_NAMED_MEMBER_MARK; \
+          formatter << x; \
+      }
 #  define DEBUG_REPR(...) \
       template <class debug_formatter> \
       void DEBUG_FORMATTER_REPR_NAME(debug_formatter formatter) const { \
@@ -1939,12 +6652,15 @@ public:
           formatter.os << DEBUG_TUPLE_BRACE[1]; \
       }
 #  define DEBUG_REPR_GLOBAL_ON_EACH(x) \
-      if (add_comma) \
-          formatter.os << DEBUG_TUPLE_COMMA; \
-      else \
-          add_comma = true; \
-      formatter.os << #x DEBUG_NAMED_MEMBER_MARK; \
-      formatter << object.x;
+      if (!formatter.full(add_comma ? DEBUG_TUPLE_COMMA : "", \
+                          #x DEBUG_NAMED_MEMBER_MARK)) { \
+          if (add_comma) \
+              formatter.os << DEBUG_TUPLE_COMMA; \
+          else \
+              add_comma = true; \
+          formatter.os << #x DEBUG_NAMED_MEMBER_MARK; \
+          formatter << object.x; \
+      }
 #  define DEBUG_REPR_GLOBAL(T, ...) \
       template <class debug_formatter> \
       void DEBUG_FORMATTER_REPR_NAME(debug_formatter formatter, \
@@ -1967,11 +6683,53 @@ public:
 # endif
 DEBUG_NAMESPACE_END
 #else
+# include <cstdint>
+# if DEBUG_SINKS
+#  include <memory>
+# endif
 # include <string>
+# include <vector>
+# if DEBUG_RELEASE_CHECKS
+#  include <exception>
+#  include <iostream>
+#  include <sstream>
+#  include <stdexcept>
+#  include <type_traits>
+#  if defined(__has_builtin)
+#   if __has_builtin(__builtin_FILE) && __has_builtin(__builtin_LINE)
+#    define DEBUG_RELEASE_FILE __builtin_FILE()
+#    define DEBUG_RELEASE_LINE __builtin_LINE()
+#   endif
+#  elif (defined(__GNUC__) && !defined(__clang__)) || \
+      (defined(_MSC_VER) && _MSC_VER >= 1927)
+#   define DEBUG_RELEASE_FILE __builtin_FILE()
+#   define DEBUG_RELEASE_LINE __builtin_LINE()
+#  endif
+#  ifndef DEBUG_RELEASE_FILE
+#   define DEBUG_RELEASE_FILE "???"
+#   define DEBUG_RELEASE_LINE 0
+#  endif
+#  if defined(__GNUC__)
+#   define DEBUG_COLD [[gnu::cold, gnu::noinline]]
+#  elif defined(_MSC_VER)
+#   define DEBUG_COLD __declspec(noinline)
+#  else
+#   define DEBUG_COLD
+#  endif
+# endif
 DEBUG_NAMESPACE_BEGIN
 
 struct debug {
+# if DEBUG_RELEASE_CHECKS
+    debug(bool enable = true, char const * = nullptr,
+          char const *loc_file = DEBUG_RELEASE_FILE,
+          int loc_line = DEBUG_RELEASE_LINE) noexcept
+        : file(loc_file),
+          line(loc_line),
+          enabled(enable) {}
+# else
     debug(bool = true, char const * = nullptr) noexcept {}
+# endif
 
     debug(debug &&) = delete;
     debug(debug const &) = delete;
@@ -1986,17 +6744,252 @@ struct debug {
         return *this;
     }
 
+# if DEBUG_RELEASE_CHECKS
+    debug &on(bool enable) {
+        enabled = enabled && enable;
+        return *this;
+    }
+# else
     debug &on(bool) {
         return *this;
     }
+# endif
+
+    template <class F>
+    debug &lazy(F &&) noexcept {
+        return *this;
+    }
 
+# if DEBUG_RELEASE_CHECKS
+    debug &fail(bool fail = true) {
+        if (fail) {
+            debug_check_panic(file, line, enabled, "failed:");
+        }
+        return *this;
+    }
+# else
     debug &fail(bool = true) {
         return *this;
     }
+# endif
+
+    static void flush() {}
+
+    struct call_site_info {
+        char const *file;
+        int line;
+        char const *function;
+        bool enabled;
+    };
+
+    static void set_sites(std::string const &) {}
+
+    static void dump_flight_recorder() {}
+
+    static void set_thread_name(std::string const &) {}
+
+    static std::vector<call_site_info> call_sites() {
+        return {};
+    }
+
+# if DEBUG_SINKS
+    struct sink {
+        virtual ~sink() = default;
+        virtual void write(char const *data, std::size_t size) = 0;
+
+        virtual void flush() {}
+    };
+
+    struct fd_sink : sink {
+        explicit fd_sink(int) noexcept {}
+
+        explicit fd_sink(std::string const &) noexcept {}
+
+        void write(char const *, std::size_t) override {}
+    };
+
+    struct file_sink : sink {
+        explicit file_sink(std::string const &, std::size_t = 0) noexcept {}
+
+        void write(char const *, std::size_t) override {}
+    };
+
+    struct rotating_file_sink : sink {
+        rotating_file_sink(std::string const &, std::size_t, std::size_t = 0,
+                           std::size_t = 0) noexcept {}
+
+        void write(char const *, std::size_t) override {}
+    };
+
+    struct fanout_sink : sink {
+        explicit fanout_sink(std::vector<std::shared_ptr<sink>> const &) {}
+
+        void write(char const *, std::size_t) override {}
+    };
+
+    struct mmap_ring_sink : sink {
+        explicit mmap_ring_sink(std::string const &,
+                                std::size_t = 0) noexcept {}
+
+        void write(char const *, std::size_t) override {}
+    };
+
+    static void set_sink(std::shared_ptr<sink> const &) {}
+# endif
 
     ~debug() noexcept(false) {}
 
 private:
+# if DEBUG_RELEASE_CHECKS
+    char const *file;
+    int line;
+    bool enabled;
+
+    template <class T>
+    static auto debug_check_operand(std::ostream &oss, T const &t, int)
+        -> decltype(oss << t, void()) {
+        oss << t;
+    }
+
+    template <class T>
+    static void debug_check_operand(std::ostream &oss, T const &t, ...) {
+        oss << DEBUG_UNKNOWN_TYPE_BRACE[0] << DEBUG_UNKNOWN_TYPE_AT
+            << static_cast<void const *>(&t) << DEBUG_UNKNOWN_TYPE_BRACE[1];
+    }
+
+    // everything but the comparison itself lives out of line, so that a
+    // passing check costs one compare and one branch at the call site
+    DEBUG_COLD static void debug_check_panic(char const *file, int line,
+                                             bool enabled,
+                                             std::string const &msg) {
+        if (!enabled) {
+            return;
+        }
+        // the same location mark as debug builds print
+        for (char const *fp = file; *fp; ++fp) {
+            if (*fp == '/') {
+                file = fp + 1;
+            }
+        }
+        std::string out = file;
+        out += DEBUG_SEPARATOR_FILE;
+        out += std::to_string(line);
+        out += DEBUG_SEPARATOR_LINE;
+        out += DEBUG_SEPARATOR_TAB;
+        out += msg;
+#  if DEBUG_PANIC_METHOD == 0
+        throw std::runtime_error(out);
+#  else
+        out += '\n';
+        DEBUG_OUTPUT(out);
+#   if DEBUG_PANIC_METHOD == 1
+#    if defined(DEBUG_PANIC_CUSTOM_TRAP)
+        DEBUG_PANIC_CUSTOM_TRAP;
+#    elif defined(_MSC_VER)
+        __debugbreak();
+#    elif defined(__GNUC__) && defined(__has_builtin)
+#     if __has_builtin(__builtin_trap)
+        __builtin_trap();
+#     else
+        std::terminate();
+#     endif
+#    else
+        std::terminate();
+#    endif
+#   elif DEBUG_PANIC_METHOD == 2
+        std::terminate();
+#   endif
+#  endif
+    }
+
+    // scalar operands are passed by value, so that they can stay in registers
+    template <class T>
+    using debug_check_arg =
+        typename std::conditional<std::is_scalar<T>::value, T,
+                                  T const &>::type;
+
+    template <class T, class U>
+    DEBUG_COLD static void
+    debug_check_failed(char const *file, int line, bool enabled,
+                       debug_check_arg<T> t, char const *sym,
+                       debug_check_arg<U> u) {
+        if (!enabled) {
+            return;
+        }
+        std::ostringstream oss;
+        oss << std::boolalpha << "assertion failed: ";
+        debug_check_operand(oss, t, 0);
+        oss << ' ' << sym << ' ';
+        debug_check_operand(oss, u, 0);
+        debug_check_panic(file, line, enabled, oss.str());
+    }
+
+    template <class T>
+    struct debug_condition {
+    private:
+        debug &d;
+        T const &t;
+
+    public:
+        explicit debug_condition(debug &dbg, T const &lhs) noexcept
+            : d(dbg),
+              t(lhs) {}
+
+        template <class U>
+        debug &operator<(U const &u) {
+            if (!(t < u)) {
+                debug_check_failed<T, U>(d.file, d.line, d.enabled, t, "<",
+                                         u);
+            }
+            return d;
+        }
+
+        template <class U>
+        debug &operator>(U const &u) {
+            if (!(t > u)) {
+                debug_check_failed<T, U>(d.file, d.line, d.enabled, t, ">",
+                                         u);
+            }
+            return d;
+        }
+
+        template <class U>
+        debug &operator<=(U const &u) {
+            if (!(t <= u)) {
+                debug_check_failed<T, U>(d.file, d.line, d.enabled, t, "<=",
+                                         u);
+            }
+            return d;
+        }
+
+        template <class U>
+        debug &operator>=(U const &u) {
+            if (!(t >= u)) {
+                debug_check_failed<T, U>(d.file, d.line, d.enabled, t, ">=",
+                                         u);
+            }
+            return d;
+        }
+
+        template <class U>
+        debug &operator==(U const &u) {
+            if (!(t == u)) {
+                debug_check_failed<T, U>(d.file, d.line, d.enabled, t, "==",
+                                         u);
+            }
+            return d;
+        }
+
+        template <class U>
+        debug &operator!=(U const &u) {
+            if (!(t != u)) {
+                debug_check_failed<T, U>(d.file, d.line, d.enabled, t, "!=",
+                                         u);
+            }
+            return d;
+        }
+    };
+# else
     struct debug_condition {
         debug &d;
 
@@ -2032,6 +7025,7 @@ private:
             return d;
         }
     };
+# endif
 
 public:
     template <class... Ts>
@@ -2043,6 +7037,37 @@ public:
         return *this;
     }
 
+    debug &limit(std::size_t) noexcept {
+        return *this;
+    }
+
+    debug &max_bytes(std::size_t) noexcept {
+        return *this;
+    }
+
+    debug &every(std::uint64_t) noexcept {
+        return *this;
+    }
+
+    debug &first(std::uint64_t) noexcept {
+        return *this;
+    }
+
+    debug &rate_per_sec(std::uint64_t) noexcept {
+        return *this;
+    }
+
+# if DEBUG_RELEASE_CHECKS
+    template <class T>
+    debug_condition<T> check(T const &t) noexcept {
+        return debug_condition<T>{*this, t};
+    }
+
+    template <class T>
+    debug_condition<T> operator>>(T const &t) noexcept {
+        return debug_condition<T>{*this, t};
+    }
+# else
     template <class T>
     debug_condition check(T const &) noexcept {
         return debug_condition{*this};
@@ -2052,6 +7077,7 @@ public:
     debug_condition operator>>(T const &) noexcept {
         return debug_condition{*this};
     }
+# endif
 
     operator std::string() {
         return {};
@@ -2069,6 +7095,11 @@ public:
     template <class T>
     static void hexdump(T const &) {}
 
+    template <class T>
+    static void xxd(T const &) {}
+
+    static void xxd(void const *, std::size_t) {}
+
     struct debug_formatter {
         std::ostream &os;
 
@@ -2079,6 +7110,7 @@ public:
     };
 };
 
+# define DEBUG_LAZY(...)
 # define DEBUG_REPR(...)
 # define DEBUG_REPR_GLOBAL(...)
 # define DEBUG_REPR_GLOBAL_TEMPLATED(...)
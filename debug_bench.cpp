@@ -0,0 +1,136 @@
+// g++ -std=c++17 -O2 debug_bench.cpp -I . -o /tmp/a.out && /tmp/a.out
+#define TINYBENCH_IMPL
+#include "tinybench.hpp"
+#include "debug.hpp"
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+
+static std::atomic<std::size_t> allocations{0};
+
+void *operator new(std::size_t n) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void *p = std::malloc(n ? n : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept {
+    std::free(p);
+}
+
+struct null_streambuf : std::streambuf {
+    int_type overflow(int_type c) override {
+        return traits_type::not_eof(c);
+    }
+
+    std::streamsize xsputn(char const *, std::streamsize n) override {
+        return n;
+    }
+};
+
+// a hand written reference, not the earlier debug.hpp: the same text built
+// the way debug() once did, with a fresh std::ostringstream per line and one
+// more copy out of it through oss.str()
+static void ostringstream_line(int i, double x) {
+    std::ostringstream oss;
+    oss << "  0.000 debug_bench.cpp:50:\t" << "value" << ' ' << i << ' ' << x
+        << '\n';
+    std::cerr << oss.str();
+}
+
+static void debug_line(int i, double x) {
+    debug(), "value", i, x;
+}
+
+template <class F>
+static double allocations_per_line(F f) {
+    f(0, 0.0);
+    int const n = 10000;
+    std::size_t before = allocations.load();
+    for (int i = 0; i < n; ++i) {
+        f(i, i * 0.5);
+    }
+    return double(allocations.load() - before) / n;
+}
+
+BENCHMARK(BM_ostringstream_line) {
+    int i = 0;
+    for (auto _: h) {
+        ostringstream_line(i++, 3.14);
+    }
+}
+
+BENCHMARK(BM_debug_line) {
+    int i = 0;
+    for (auto _: h) {
+        debug_line(i++, 3.14);
+    }
+}
+
+BENCHMARK(BM_debug_vector_double) {
+    std::vector<double> v(10000);
+    for (std::size_t i = 0; i < v.size(); ++i) {
+        v[i] = i * 0.37;
+    }
+    for (auto _: h) {
+        debug(), v;
+    }
+}
+
+BENCHMARK(BM_debug_long_string) {
+    std::string s;
+    for (int i = 0; i < 4096; ++i) {
+        s += "the quick brown fox jumps over the lazy dog"[i % 43];
+    }
+    s[2048] = '\n';
+    for (auto _: h) {
+        debug(), s;
+    }
+}
+
+BENCHMARK(BM_debug_xxd_1m) {
+    std::vector<unsigned char> buf(1 << 20);
+    for (std::size_t i = 0; i < buf.size(); ++i) {
+        buf[i] = static_cast<unsigned char>(i * 131);
+    }
+    for (auto _: h) {
+        debug().limit(0), debug::xxd(buf);
+    }
+}
+
+BENCHMARK(BM_debug_hexdump_1m) {
+    std::vector<unsigned char> buf(1 << 20);
+    for (std::size_t i = 0; i < buf.size(); ++i) {
+        buf[i] = static_cast<unsigned char>(i * 131);
+    }
+    for (auto _: h) {
+        debug().limit(0), debug::hexdump(buf);
+    }
+}
+
+int main() {
+    null_streambuf null;
+    std::streambuf *old = std::cerr.rdbuf(&null);
+    double reference = allocations_per_line(ostringstream_line);
+    double current = allocations_per_line(debug_line);
+    std::unique_ptr<tinybench::Reporter> rep(
+        tinybench::makeConsoleReporter());
+    rep->run_all();
+    std::cerr.rdbuf(old);
+    std::printf("allocations per line: std::ostringstream reference %.2f, "
+                "debug() %.2f\n",
+                reference, current);
+    return 0;
+}
@@ -0,0 +1,61 @@
+// release checks against a hand written branch, both should run at the same
+// speed, and `g++ -O2 -S` should show checked_at() as a compare and branch
+// around the load with no call, the message building only in its .cold part
+// (run.sh has the command that checks this):
+// g++ -std=c++17 -O2 debug_check_bench.cpp -I . -o /tmp/a.out && /tmp/a.out
+#define TINYBENCH_IMPL
+#define DEBUG_LEVEL 0
+#define DEBUG_RELEASE_CHECKS 1
+#define DEBUG_PANIC_METHOD 0
+#include "tinybench.hpp"
+#include "debug.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+__attribute__((noinline)) int plain_at(std::vector<int> const &v,
+                                       std::size_t i) {
+    if (!(i < v.size())) {
+        std::abort();
+    }
+    return v[i];
+}
+
+__attribute__((noinline)) int checked_at(std::vector<int> const &v,
+                                         std::size_t i) {
+    debug().check(i) < v.size();
+    return v[i];
+}
+
+BENCHMARK(BM_plain_branch) {
+    std::vector<int> v(1024, 1);
+    std::size_t i = 0;
+    for (auto _: h) {
+        tinybench::do_not_optimize(plain_at(v, i++ & 1023));
+    }
+}
+
+BENCHMARK(BM_release_check) {
+    std::vector<int> v(1024, 1);
+    std::size_t i = 0;
+    for (auto _: h) {
+        tinybench::do_not_optimize(checked_at(v, i++ & 1023));
+    }
+}
+
+int main() {
+    std::vector<int> v(4);
+    try {
+        checked_at(v, 4);
+        std::printf("release check did not fire\n");
+        return 1;
+    } catch (std::runtime_error const &e) {
+        std::printf("%s\n", e.what());
+    }
+    std::unique_ptr<tinybench::Reporter> rep(
+        tinybench::makeConsoleReporter());
+    rep->run_all();
+    return 0;
+}
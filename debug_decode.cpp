@@ -0,0 +1,27 @@
+// decodes the binary log written by DEBUG_DEFERRED_FILE into text, must be
+// built with the same DEBUG_xxx macros as the program that wrote the log:
+// g++ -std=c++17 debug_decode.cpp -I . -o debug_decode && ./debug_decode debug.bin
+#define DEBUG_LEVEL 1
+#ifndef DEBUG_DEFERRED
+# define DEBUG_DEFERRED 1
+#endif
+#include "debug.hpp"
+#include <fstream>
+#include <iostream>
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        std::cerr << "usage: " << argv[0] << " debug.bin\n";
+        return 2;
+    }
+    std::ifstream in(argv[1], std::ios::binary);
+    if (!in) {
+        std::cerr << argv[1] << ": cannot open file\n";
+        return 1;
+    }
+    if (!debug::deferred_decode(in, std::cout)) {
+        std::cerr << argv[1] << ": malformed or incompatible debug log\n";
+        return 1;
+    }
+    return 0;
+}
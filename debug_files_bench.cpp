@@ -0,0 +1,44 @@
+// DEBUG_FILES lookups, in their own program so that the other benchmarks
+// measure the default build:
+// g++ -std=c++17 -O2 debug_files_bench.cpp -I . -o /tmp/a.out && /tmp/a.out
+#define TINYBENCH_IMPL
+#define DEBUG_ENABLE_FILES_MATCH 1
+#include "tinybench.hpp"
+#include "debug.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <string_view>
+
+// a DEBUG_FILES list of 10k files, set up in main() before the first debug()
+static std::string files_10k;
+
+// what each debug() construction used to cost with DEBUG_FILES set
+BENCHMARK(BM_files_substring_10k) {
+    char const *files = files_10k.c_str();
+    for (auto _: h) {
+        std::string_view sv = files;
+        bool found = sv.find(__FILE__) != sv.npos;
+        tinybench::do_not_optimize(found);
+    }
+}
+
+// this file is not in the list, so every debug() here is suppressed
+BENCHMARK(BM_debug_files_suppressed_10k) {
+    int i = 0;
+    for (auto _: h) {
+        debug(), "value", i++, 3.14;
+    }
+}
+
+int main() {
+    for (int i = 0; i < 10000; ++i) {
+        files_10k += "src/module" + std::to_string(i) + "/file.cpp ";
+    }
+    setenv("DEBUG_FILES", files_10k.c_str(), 1);
+    std::unique_ptr<tinybench::Reporter> rep(
+        tinybench::makeConsoleReporter());
+    rep->run_all();
+    return 0;
+}
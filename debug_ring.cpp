@@ -0,0 +1,27 @@
+// prints the lines kept in a ring file written by debug::mmap_ring_sink,
+// oldest first, also works on the file left behind by a crashed program:
+// g++ -std=c++17 debug_ring.cpp -I . -o debug_ring && ./debug_ring debug.ring
+#define DEBUG_LEVEL 1
+#ifndef DEBUG_SINKS
+# define DEBUG_SINKS 1
+#endif
+#include "debug.hpp"
+#include <fstream>
+#include <iostream>
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        std::cerr << "usage: " << argv[0] << " debug.ring\n";
+        return 2;
+    }
+    std::ifstream in(argv[1], std::ios::binary);
+    if (!in) {
+        std::cerr << argv[1] << ": cannot open file\n";
+        return 1;
+    }
+    if (!debug::ring_decode(in, std::cout)) {
+        std::cerr << argv[1] << ": not a debug ring file\n";
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,43 @@
+// output sinks, in their own program so that the other benchmarks measure
+// the default build:
+// g++ -std=c++17 -O2 debug_sink_bench.cpp -I . -o /tmp/a.out && /tmp/a.out
+#define TINYBENCH_IMPL
+#define DEBUG_SINKS 1
+#include "tinybench.hpp"
+#include "debug.hpp"
+#include <memory>
+
+static void debug_line(int i, double x) {
+    debug(), "value", i, x;
+}
+
+// opened once, so that each benchmark only switches to its sink
+static std::shared_ptr<debug::sink> const fd_sink =
+    std::make_shared<debug::fd_sink>("/dev/null");
+static std::shared_ptr<debug::sink> const file_sink =
+    std::make_shared<debug::file_sink>("/dev/null");
+
+// one write(2) per line, against lines coalesced into 64 KiB writev(2)s
+BENCHMARK(BM_debug_fd_sink) {
+    debug::set_sink(fd_sink);
+    int i = 0;
+    for (auto _: h) {
+        debug_line(i++, 3.14);
+    }
+}
+
+BENCHMARK(BM_debug_file_sink) {
+    debug::set_sink(file_sink);
+    int i = 0;
+    for (auto _: h) {
+        debug_line(i++, 3.14);
+    }
+}
+
+int main() {
+    std::unique_ptr<tinybench::Reporter> rep(
+        tinybench::makeConsoleReporter());
+    rep->run_all();
+    debug::set_sink(nullptr);
+    return 0;
+}
@@ -1,2 +1,8 @@
 # g++ -std=c++11 test.cpp -I . -o /tmp/a.out && /tmp/a.out
+# g++ -std=c++17 -fsanitize=thread -DDEBUG_FLIGHT_RECORDER=8 test.cpp -I . -pthread -o /tmp/a.out && /tmp/a.out
+# g++ -std=c++17 -O2 debug_bench.cpp -I . -o /tmp/a.out && /tmp/a.out
+# g++ -std=c++17 -O2 debug_check_bench.cpp -I . -o /tmp/a.out && /tmp/a.out
+# g++ -std=c++17 -O2 -S debug_check_bench.cpp -I . -o /tmp/a.s && grep -q '^_Z10checked_atRKSt6vectorIiSaIiEEm\.cold:' /tmp/a.s && ! sed -n '/^_Z10checked_atRKSt6vectorIiSaIiEEm:/,/\.cfi_endproc/p' /tmp/a.s | grep -q call && echo 'checked_at: no call on the hot path'
+# g++ -std=c++17 -O2 debug_files_bench.cpp -I . -o /tmp/a.out && /tmp/a.out
+# g++ -std=c++17 -O2 debug_sink_bench.cpp -I . -o /tmp/a.out && /tmp/a.out
 g++ -std=c++20 -DNDEBUG -O3 perf_test.cpp -I . -o /tmp/a.out && /tmp/a.out
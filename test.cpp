@@ -24,6 +24,10 @@
 #include <string>
 #include <vector>
 #include <functional>
+#if DEBUG_FLIGHT_RECORDER
+# include <atomic>
+# include <thread>
+#endif
 
 struct Student {
     std::string name;
@@ -51,6 +55,18 @@ struct Student4 {
     DEBUG_REPR();
 };
 
+struct Node {
+    int value;
+    std::shared_ptr<Node> next;
+
+    DEBUG_REPR(value, next);
+};
+
+inline bool ends_with(std::string const &s, std::string const &suffix) {
+    return s.size() >= suffix.size() &&
+           s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
 int main() {
     debug(), 'a';
     debug(), (unsigned char)'a';
@@ -181,6 +197,95 @@ int main() {
     int z16 = 0xdeadbeaf;
     debug(), debug::hexdump(z16);
 
+    int z17 = 0;
+    DEBUG_LAZY(debug().on(false), "never evaluated:", ++z17);
+    DEBUG_LAZY(debug(), "evaluated only when printed:", ++z17);
+#if !DEBUG_LEVEL
+    if (z17 != 0) {
+#else
+    if (z17 != 1) {
+#endif
+        std::cerr << "DEBUG_LAZY evaluated arguments of a suppressed line\n";
+        return 1;
+    }
+
+    auto z18 = std::make_shared<Node>();
+    z18->value = 1;
+    z18->next = std::make_shared<Node>();
+    z18->next->value = 2;
+    z18->next->next = z18;
+    auto z19 = static_cast<std::string>(debug(), "cycle:", z18);
+    std::cerr << z19 << '\n';
+    z18->next->next = nullptr;
+    std::vector<std::shared_ptr<Node>> z20{z18->next, z18->next};
+    auto z21 = static_cast<std::string>(debug(), "dag:", z20);
+    std::cerr << z21 << '\n';
+    std::shared_ptr<int> z22(z18, &z18->value);
+    auto z23 = static_cast<std::string>(debug(), "alias:", z18, z22);
+    std::cerr << z23 << '\n';
+#if DEBUG_LEVEL && DEBUG_SMART_POINTER_MODE == 1
+    if (!ends_with(z19, "cycle: #1={value: 1, next: {value: 2, next: "
+                        "<ref #1>}}") ||
+        !ends_with(z21, "dag: {#1={value: 2, next: nullptr}, <ref #1>}") ||
+        !ends_with(z23, "alias: {value: 1, next: {value: 2, next: "
+                        "nullptr}} 1")) {
+        std::cerr << "objects behind smart pointers printed wrongly\n";
+        return 1;
+    }
+#endif
+
+    std::vector<std::vector<int>> z24(3, std::vector<int>(20, 3));
+    auto z25 = static_cast<std::string>(debug().max_bytes(60).limit(4),
+                                        "v =", z24, "after", 42);
+    std::cerr << z25 << '\n';
+#if DEBUG_LEVEL
+    if (z25.find("(truncated)") == std::string::npos ||
+        z25.find(", ... (truncated)") != std::string::npos ||
+        z25.find(", }") != std::string::npos ||
+        z25.find("after") != std::string::npos) {
+        std::cerr << "truncated line left a separator or went on\n";
+        return 1;
+    }
+#endif
+
+#if DEBUG_LEVEL && DEBUG_COALESCE
+    // past one xxd chunk, the line is still kept whole to be compared
+    std::vector<unsigned char> z26(8192);
+    for (std::size_t i = 0; i < z26.size(); ++i) {
+        z26[i] = static_cast<unsigned char>(i * 131);
+    }
+    for (int i = 0; i < 2; ++i) {
+        debug().limit(0), "big:", debug::xxd(z26);
+    }
+    auto z27 = static_cast<std::string>(debug().limit(0), debug::xxd(z26));
+    if (z27.size() < z26.size() * 4) {
+        std::cerr << "coalesced line was output in chunks\n";
+        return 1;
+    }
+#endif
+
+#if DEBUG_FLIGHT_RECORDER
+    // dumped while other threads keep overwriting their rings, build with
+    // -fsanitize=thread to check it
+    std::atomic<bool> z28{false};
+    std::vector<std::thread> z29;
+    for (int t = 0; t < 4; ++t) {
+        z29.emplace_back([&z28, t] {
+            for (int i = 0; !z28.load(); ++i) {
+                debug(), "worker", t, i, std::string(i % 300, 'x');
+            }
+        });
+    }
+    for (int i = 0; i < 20; ++i) {
+        debug::dump_flight_recorder();
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+    }
+    z28.store(true);
+    for (auto &t: z29) {
+        t.join();
+    }
+#endif
+
     return 0;
 }
 